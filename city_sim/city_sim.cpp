@@ -8,26 +8,82 @@
 #include <sstream>
 #include <cmath>
 #include <chrono>
-#include <unordered_map>
 #include <iomanip>
 #include <deque>
+#include <cstdlib>
+#include <cstdio>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <type_traits>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// Screen dimensions
-const int SCREEN_WIDTH = 1280;
-const int SCREEN_HEIGHT = 720;
+#include "runtime.h"
 
-// Grid settings
-const int CELL_SIZE = 16; // Increased size for better visibility
-const int GRID_WIDTH = SCREEN_WIDTH / CELL_SIZE;
-const int GRID_HEIGHT = SCREEN_HEIGHT / CELL_SIZE;
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Window sizes the game is tuned for, picked with --display or from the desktop resolution
+struct DisplayPreset {
+    const char* name;
+    int width;
+    int height;
+};
+
+constexpr DisplayPreset DISPLAY_PRESETS[] = {
+    {"handheld", 640, 480},
+    {"hd", 1280, 720},
+    {"desktop", 1920, 1080}
+};
+constexpr int DISPLAY_PRESET_COUNT = sizeof(DISPLAY_PRESETS) / sizeof(DISPLAY_PRESETS[0]);
+constexpr int HD_DISPLAY = 1;  // Headless runs and displays that report no mode
+
+// Screen dimensions of the chosen preset
+int screenWidth = DISPLAY_PRESETS[HD_DISPLAY].width;
+int screenHeight = DISPLAY_PRESETS[HD_DISPLAY].height;
+
+// Grid settings. The cell size stays fixed, sprites and chunk textures are baked at it.
+constexpr int CELL_SIZE = 16; // Increased size for better visibility
+constexpr int DEFAULT_GRID_WIDTH = DISPLAY_PRESETS[HD_DISPLAY].width / CELL_SIZE;
+constexpr int DEFAULT_GRID_HEIGHT = DISPLAY_PRESETS[HD_DISPLAY].height / CELL_SIZE;
+const int MIN_GRID_SIZE = 16;
+const int MAX_GRID_SIZE = 4096;
 
 // Simulation constants
-const int INITIAL_ROADS = 30;
+const float MIN_CAR_GAP = 0.5f;  // Cells kept free in front of a car, queued cars stop short of this
+const int MAX_CAR_WAIT = 50;  // Steps a car may stay blocked before it gives up and teleports
+const int REGION_CELLS = 16;  // Side of the square destination regions cars are routed to
+const size_t FLOW_FIELD_BUDGET = 32 << 20;  // Bytes of cached routing fields, least recently used are rebuilt
+const int MIN_FLOW_FIELDS = 64;
+const int FLOW_FIELD_HEADROOM = 8;  // Growing fields reserve 1/this extra roads, so they rarely reallocate
 const int MAX_SIMULATION_STEPS = 10000;
+const int DENSITY_GROWTH_INTERVAL = 20;  // Growth ticks between density rolls
+const int TREE_GROWTH_INTERVAL = 30;  // Growth ticks between tree rolls for residential buildings
+const int MAX_DENSITY = 3;
+const int TILE_CELLS = 64;  // Side of the square tiles growth work is partitioned into
+const int TERRAIN_MARGIN = TILE_CELLS / 2;  // Cells terrain features may reach past their own tile
+const int MAX_THREADS = 64;
+const int MIN_PARALLEL_TILES = 16;  // Smaller maps run tile work inline, waking workers costs more
 const Uint32 SIMULATION_DELAY = 300;  // Increased delay to slow down growth
+const int MAX_STEPS_PER_FRAME = 5;  // Catch-up limit, older backlog is dropped
+const Uint32 WATER_ANIM_DELAY = 200;
 
 // Cell types
-enum CellType {
+enum CellType : Uint8 {
     EMPTY = 0,
     ROAD = 1,
     RESIDENTIAL = 2,
@@ -40,9 +96,14 @@ enum CellType {
     FOREST = 9,
     FARM = 10
 };
+const int CELL_TYPE_COUNT = FARM + 1;
+const char* const CELL_TYPE_NAMES[CELL_TYPE_COUNT] = {
+    "empty", "road", "residential", "commercial", "industrial", "water",
+    "park", "power_plant", "government", "forest", "farm"
+};
 
 // Building style
-enum BuildingStyle {
+enum BuildingStyle : Uint8 {
     BASIC = 0,
     MODERN = 1,
     HISTORIC = 2,
@@ -66,726 +127,2947 @@ const SDL_Color COLOR_FARM = {180, 210, 100, 255};
 const int dx[] = {-1, 0, 1, 0, -1, -1, 1, 1};
 const int dy[] = {0, 1, 0, -1, -1, 1, 1, -1};
 
-// Structure to represent a building
+// Road connectivity mask bits, bit d is set when the neighbor in direction d is a road
+const int ROAD_WEST = 1 << 0;
+const int ROAD_SOUTH = 1 << 1;
+const int ROAD_EAST = 1 << 2;
+const int ROAD_NORTH = 1 << 3;
+const int ROAD_MASK_COUNT = 16;
+
+// Per-mask number of set bits and the direction of the n-th set bit, for allocation-free turn choice
+struct RoadDirectionTable {
+    Uint8 count[ROAD_MASK_COUNT];
+    Uint8 nth[ROAD_MASK_COUNT][4];
+    
+    RoadDirectionTable() : count(), nth() {
+        for (int mask = 0; mask < ROAD_MASK_COUNT; mask++) {
+            for (int d = 0; d < 4; d++) {
+                if (mask & (1 << d)) {
+                    nth[mask][count[mask]++] = static_cast<Uint8>(d);
+                }
+            }
+        }
+    }
+};
+
+const RoadDirectionTable roadDirections;
+
+// Structure to represent a building (packed to 6 bytes to keep the grid cache-friendly)
 struct Building {
     CellType type;
-    int density;
-    int age;
+    Uint8 density;
     BuildingStyle style;
-    int variant;
+    Uint8 variant;
     bool hasTree;
     bool hasCar;
 };
+static_assert(sizeof(Building) == 6, "Building should stay packed");
 
-// Structure to represent a car
-struct Car {
-    float x, y;
-    float speed;
-    int direction;
-    int roadIndex;
-    SDL_Color color;
+// Row-major 2D grid stored in one contiguous buffer, indexed (x, y)
+template <typename T>
+class Grid2D {
+public:
+    void resize(int w, int h, const T& value) {
+        width = w;
+        height = h;
+        cells.assign(static_cast<size_t>(w) * h, value);
+    }
+    
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    
+    bool inBounds(int x, int y) const {
+        return static_cast<unsigned>(x) < static_cast<unsigned>(width) &&
+               static_cast<unsigned>(y) < static_cast<unsigned>(height);
+    }
+    
+    int index(int x, int y) const { return y * width + x; }
+    
+    T& operator()(int x, int y) { return cells[index(x, y)]; }
+    const T& operator()(int x, int y) const { return cells[index(x, y)]; }
+    
+    // Bounds-checked read, returns fallback for cells outside the grid
+    T get(int x, int y, const T& fallback) const {
+        return inBounds(x, y) ? cells[index(x, y)] : fallback;
+    }
+    
+    // Row-major cell storage, for bulk copies
+    T* data() { return cells.data(); }
+    const T* data() const { return cells.data(); }
+    
+private:
+    int width = 0;
+    int height = 0;
+    std::vector<T> cells;
 };
 
-// City grid and related data
-std::vector<std::vector<CellType>> grid;
-std::vector<std::vector<Building>> buildings;
-std::vector<Car> cars;
-std::vector<std::pair<int, int>> roads;
-std::vector<std::pair<int, int>> waterCells;
-int currentStep = 0;
-Uint32 lastWaterAnimTime = 0;
-int waterAnimPhase = 0;
+// Map dimensions known at compile time, so loops over a grid of this shape get constant
+// bounds and strides: the compiler unrolls them and power of two widths index with shifts
+template <int W, int H>
+struct FixedGridShape {
+    static constexpr int width() { return W; }
+    static constexpr int height() { return H; }
+};
 
-// Water animation colors
-const int WATER_ANIM_PHASES = 8;
-SDL_Color waterColors[WATER_ANIM_PHASES];
+// Any other map size, same interface with the bounds read at run time
+struct DynamicGridShape {
+    int w;
+    int h;
+    int width() const { return w; }
+    int height() const { return h; }
+};
 
-// Random number generation
-std::random_device rd;
-std::mt19937 gen(rd());
+template <int Display>
+using DisplayGridShape = FixedGridShape<DISPLAY_PRESETS[Display].width / CELL_SIZE,
+                                        DISPLAY_PRESETS[Display].height / CELL_SIZE>;
 
-// Function prototypes
-void initializeGrid();
-void simulationStep();
-void drawGrid(SDL_Renderer* renderer);
-void generateInitialRoads();
-void generateTerrain();
-bool isValidCell(int x, int y);
-int countNeighborsOfType(int x, int y, CellType type);
-int countNeighborsOfTypeInRadius(int x, int y, CellType type, int radius);
-void growCity();
-void updateCars();
-void drawCars(SDL_Renderer* renderer);
-void addRandomCar();
-SDL_Color getBuildingColor(const Building& building);
-void drawBuilding(SDL_Renderer* renderer, int x, int y, const Building& building);
-void drawWater(SDL_Renderer* renderer, int x, int y);
-void drawRoad(SDL_Renderer* renderer, int x, int y);
-void drawTree(SDL_Renderer* renderer, int x, int y, int size);
-void initializeWaterAnimation();
-void updateWaterAnimation();
+template <typename... Shapes>
+struct GridShapeList {};
 
-// Initialize water animation colors
-void initializeWaterAnimation() {
-    waterColors[0] = {20, 100, 200, 255};
-    waterColors[1] = {25, 110, 205, 255};
-    waterColors[2] = {30, 120, 210, 255};
-    waterColors[3] = {35, 130, 215, 255};
-    waterColors[4] = {40, 140, 220, 255};
-    waterColors[5] = {35, 130, 215, 255};
-    waterColors[6] = {30, 120, 210, 255};
-    waterColors[7] = {25, 110, 205, 255};
-}
+// Specialized map sizes: the default map of each display preset and the square maps used for
+// benchmarks. Each one adds a copy of every shaped loop to the binary, so keep the list short.
+using BuiltInGridShapes = GridShapeList<
+    DisplayGridShape<0>, DisplayGridShape<1>, DisplayGridShape<2>,
+    FixedGridShape<256, 256>, FixedGridShape<512, 512>, FixedGridShape<1024, 1024>,
+    FixedGridShape<2048, 2048>, FixedGridShape<4096, 4096>>;
 
-// Update water animation phase
-void updateWaterAnimation() {
-    Uint32 currentTime = SDL_GetTicks();
-    if (currentTime - lastWaterAnimTime > 200) {
-        waterAnimPhase = (waterAnimPhase + 1) % WATER_ANIM_PHASES;
-        lastWaterAnimTime = currentTime;
+// Call visit with the built-in shape matching the map size, or a DynamicGridShape
+template <typename... Shapes, typename Visit>
+void visitGridShape(GridShapeList<Shapes...>, int w, int h, Visit&& visit) {
+    bool matched = ((w == Shapes::width() && h == Shapes::height() && (visit(Shapes()), true)) || ...);
+    if (!matched) {
+        visit(DynamicGridShape{w, h});
     }
 }
 
-// Check if coordinates are within grid bounds
-bool isValidCell(int x, int y) {
-    return x >= 0 && x < GRID_WIDTH && y >= 0 && y < GRID_HEIGHT;
+template <typename Visit>
+void visitGridShape(int w, int h, Visit&& visit) {
+    visitGridShape(BuiltInGridShapes(), w, h, visit);
 }
 
-// Count neighbors of a specific type (using 4 directions)
-int countNeighborsOfType(int x, int y, CellType type) {
-    int count = 0;
-    for (int i = 0; i < 4; i++) {
-        int nx = x + dx[i];
-        int ny = y + dy[i];
-        if (isValidCell(nx, ny) && grid[nx][ny] == type) {
-            count++;
-        }
-    }
-    return count;
+// True if the map size has specialized loops, reported by headless runs
+bool isBuiltInGridShape(int w, int h) {
+    bool builtIn = false;
+    visitGridShape(w, h, [&](auto shape) {
+        builtIn = !std::is_same<decltype(shape), DynamicGridShape>::value;
+    });
+    return builtIn;
 }
 
-// Count neighbors of a specific type within a radius
-int countNeighborsOfTypeInRadius(int x, int y, CellType type, int radius) {
-    int count = 0;
-    for (int i = -radius; i <= radius; i++) {
-        for (int j = -radius; j <= radius; j++) {
-            if (i == 0 && j == 0) continue;
-            int nx = x + i;
-            int ny = y + j;
-            if (isValidCell(nx, ny) && grid[nx][ny] == type) {
-                count++;
+// splitmix64 step, used to expand one seed into independent stream seeds
+Uint64 splitMix64(Uint64& state) {
+    Uint64 z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// PCG32 (XSH-RR) generator: 16 bytes of state, and each odd increment selects an independent stream
+class Rng {
+public:
+    using result_type = Uint32;
+    
+    // Complete generator state, as stored in save files
+    struct State {
+        Uint64 state;
+        Uint64 increment;
+    };
+    
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return 0xFFFFFFFFu; }
+    
+    void seed(Uint64 seedValue, Uint64 stream) {
+        state = 0;
+        increment = (stream << 1) | 1;
+        next();
+        state += seedValue;
+        next();
+    }
+    
+    State getState() const { return {state, increment}; }
+    void setState(const State& saved) {
+        state = saved.state;
+        increment = saved.increment;
+    }
+    
+    result_type operator()() { return next(); }
+    
+    // Uniform integer in [0, bound), Lemire's multiply-shift with rejection of the biased low range
+    Uint32 below(Uint32 bound) {
+        Uint64 product = static_cast<Uint64>(next()) * bound;
+        Uint32 low = static_cast<Uint32>(product);
+        if (low < bound) {
+            Uint32 threshold = -bound % bound;
+            while (low < threshold) {
+                product = static_cast<Uint64>(next()) * bound;
+                low = static_cast<Uint32>(product);
             }
         }
+        return static_cast<Uint32>(product >> 32);
     }
-    return count;
-}
+    
+    // Uniform integer in [lo, hi]
+    int range(int lo, int hi) {
+        return lo + static_cast<int>(below(static_cast<Uint32>(hi - lo) + 1));
+    }
+    
+    // Uniform float in [lo, hi)
+    float uniform(float lo, float hi) {
+        return lo + (hi - lo) * ((next() >> 8) * (1.0f / 16777216.0f));
+    }
+    
+private:
+    Uint32 next() {
+        Uint64 old = state;
+        state = old * 6364136223846793005ULL + increment;
+        Uint32 xorShifted = static_cast<Uint32>(((old >> 18) ^ old) >> 27);
+        Uint32 rot = static_cast<Uint32>(old >> 59);
+        return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+    }
+    
+    Uint64 state = 0x853C49E6748FEA9BULL;
+    Uint64 increment = 0xDA3E39CB94B95BDBULL;
+};
 
-// Initialize the grid with empty cells and prepare related data structures
-void initializeGrid() {
-    grid.resize(GRID_WIDTH, std::vector<CellType>(GRID_HEIGHT, EMPTY));
-    buildings.resize(GRID_WIDTH, std::vector<Building>(GRID_HEIGHT));
+// Set of cell indices with O(1) insert/erase and O(k) random sampling
+class CellSet {
+public:
+    void reset(int cellCount) {
+        items.clear();
+        slots.assign(cellCount, -1);
+    }
     
-    // Initialize all buildings to empty
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            buildings[x][y] = {EMPTY, 0, 0, BASIC, 0, false, false};
+    void clear() {
+        for (int cell : items) {
+            slots[cell] = -1;
         }
+        items.clear();
     }
     
-    // Initialize water animation
-    initializeWaterAnimation();
+    int size() const { return static_cast<int>(items.size()); }
+    bool contains(int cell) const { return slots[cell] >= 0; }
+    int operator[](int i) const { return items[i]; }
     
-    // Generate terrain features first
-    generateTerrain();
+    // Members in sampling order, which assign() restores exactly
+    const std::vector<int>& members() const { return items; }
     
-    // Generate initial roads
-    generateInitialRoads();
-}
+    void assign(const std::vector<int>& ordered) {
+        clear();
+        for (int cell : ordered) {
+            insert(cell);
+        }
+    }
+    
+    void insert(int cell) {
+        if (slots[cell] >= 0) return;
+        slots[cell] = static_cast<int>(items.size());
+        items.push_back(cell);
+    }
+    
+    void erase(int cell) {
+        int slot = slots[cell];
+        if (slot < 0) return;
+        int last = items.back();
+        items[slot] = last;
+        slots[last] = slot;
+        items.pop_back();
+        slots[cell] = -1;
+    }
+    
+    // Move up to k random members to the front (partial Fisher-Yates), returns the count picked
+    int sampleFront(int k, Rng& rng) {
+        k = std::min(k, size());
+        for (int i = 0; i < k; i++) {
+            swapSlots(i, rng.range(i, size() - 1));
+        }
+        return k;
+    }
+    
+private:
+    void swapSlots(int a, int b) {
+        std::swap(items[a], items[b]);
+        slots[items[a]] = a;
+        slots[items[b]] = b;
+    }
+    
+    std::vector<int> items;
+    std::vector<int> slots;
+};
 
-// Generate terrain features like water bodies, forests, etc.
-void generateTerrain() {
-    // Generate water bodies (rivers and lakes)
-    std::uniform_int_distribution<int> dist_water_count(1, 3);
-    int waterBodies = dist_water_count(gen);
+// All cars stored as structure-of-arrays, so the movement kernel streams over contiguous floats.
+// velX/velY cache direction * speed and must be refreshed through setDirection().
+// prevX/prevY hold the positions before the last step, for interpolated drawing.
+struct CarFleet {
+    std::vector<float> x, y;
+    std::vector<float> prevX, prevY;
+    std::vector<float> velX, velY;
+    std::vector<float> speed;
+    std::vector<Uint8> direction;
+    std::vector<int> roadIndex;
+    std::vector<SDL_Color> color;
+    std::vector<Uint16> wait;  // Consecutive steps spent queued or yielding
+    std::vector<int> destination;  // Flow field the car follows, region * 2 + TripPurpose, -1 to wander
     
-    for (int i = 0; i < waterBodies; i++) {
-        std::uniform_int_distribution<int> dist_x(5, GRID_WIDTH - 5);
-        std::uniform_int_distribution<int> dist_y(5, GRID_HEIGHT - 5);
-        int startX = dist_x(gen);
-        int startY = dist_y(gen);
+    // Per-update scratch space
+    std::vector<float> nextX, nextY;
+    std::vector<Uint8> onRoad;
+    std::vector<Uint8> blocked;
+    std::vector<int> turning;
+    
+    int size() const { return static_cast<int>(x.size()); }
+    
+    void add(float px, float py, float carSpeed, int carDirection, int road, SDL_Color carColor, int carDestination) {
+        x.push_back(px);
+        y.push_back(py);
+        prevX.push_back(px);
+        prevY.push_back(py);
+        velX.push_back(0.0f);
+        velY.push_back(0.0f);
+        speed.push_back(carSpeed);
+        direction.push_back(0);
+        roadIndex.push_back(road);
+        color.push_back(carColor);
+        wait.push_back(0);
+        destination.push_back(carDestination);
+        setDirection(size() - 1, carDirection);
+    }
+    
+    void setDirection(int i, int d) {
+        direction[i] = static_cast<Uint8>(d);
+        velX[i] = dx[d] * speed[i];
+        velY[i] = dy[d] * speed[i];
+    }
+};
+
+// Cars bucketed by the cell they occupy, rebuilt once per step with a counting sort.
+// Buckets hash the cell index, so the index is sized by the number of cars rather than the map.
+class CarIndex {
+public:
+    void build(const CarFleet& fleet, int width) {
+        int count = fleet.size();
+        bucketBits = 4;
+        while ((1 << bucketBits) < count * 2) bucketBits++;
         
-        // Generate a river or lake
-        std::uniform_int_distribution<int> dist_type(0, 1);
-        if (dist_type(gen) == 0) {
-            // River
-            int length = 15 + gen() % 20;
-            int dir = gen() % 4;
-            int curX = startX;
-            int curY = startY;
-            
-            for (int j = 0; j < length; j++) {
-                // Occasionally change direction slightly
-                if (gen() % 5 == 0) {
-                    dir = (dir + (gen() % 3 - 1)) % 4;
-                    if (dir < 0) dir += 4;
-                }
-                
-                // Create river segment and some surrounding water
-                for (int ox = -1; ox <= 1; ox++) {
-                    for (int oy = -1; oy <= 1; oy++) {
-                        int nx = curX + ox;
-                        int ny = curY + oy;
-                        if (isValidCell(nx, ny) && grid[nx][ny] == EMPTY) {
-                            grid[nx][ny] = WATER;
-                            waterCells.push_back({nx, ny});
-                        }
-                    }
-                }
-                
-                // Move to next position
-                curX += dx[dir];
-                curY += dy[dir];
-                if (!isValidCell(curX, curY)) break;
-            }
-        } else {
-            // Lake
-            std::deque<std::pair<int, int>> queue;
-            queue.push_back({startX, startY});
-            std::uniform_int_distribution<int> dist_size(20, 40);
-            int size = dist_size(gen);
-            
-            while (!queue.empty() && size > 0) {
-                auto [x, y] = queue.front();
-                queue.pop_front();
-                
-                if (!isValidCell(x, y) || grid[x][y] != EMPTY) continue;
-                
-                grid[x][y] = WATER;
-                waterCells.push_back({x, y});
-                size--;
-                
-                for (int d = 0; d < 4; d++) {
-                    std::uniform_int_distribution<int> dist_expand(0, 100);
-                    if (dist_expand(gen) < 70) { // 70% chance to expand
-                        queue.push_back({x + dx[d], y + dy[d]});
-                    }
-                }
-            }
+        cellOf.resize(count);
+        start.assign((1 << bucketBits) + 1, 0);
+        for (int i = 0; i < count; i++) {
+            cellOf[i] = static_cast<int>(fleet.y[i]) * width + static_cast<int>(fleet.x[i]);
+            start[bucket(cellOf[i]) + 1]++;
+        }
+        for (size_t b = 1; b < start.size(); b++) {
+            start[b] += start[b - 1];
+        }
+        order.resize(count);
+        cursor.assign(start.begin(), start.end() - 1);
+        for (int i = 0; i < count; i++) {
+            order[cursor[bucket(cellOf[i])]++] = i;
         }
     }
     
-    // Generate forests
-    std::uniform_int_distribution<int> dist_forest_count(2, 5);
-    int forestCount = dist_forest_count(gen);
-    
-    for (int i = 0; i < forestCount; i++) {
-        std::uniform_int_distribution<int> dist_x(5, GRID_WIDTH - 5);
-        std::uniform_int_distribution<int> dist_y(5, GRID_HEIGHT - 5);
-        int startX = dist_x(gen);
-        int startY = dist_y(gen);
-        
-        std::deque<std::pair<int, int>> queue;
-        queue.push_back({startX, startY});
-        std::uniform_int_distribution<int> dist_size(10, 30);
-        int size = dist_size(gen);
-        
-        while (!queue.empty() && size > 0) {
-            auto [x, y] = queue.front();
-            queue.pop_front();
-            
-            if (!isValidCell(x, y) || grid[x][y] != EMPTY) continue;
-            
-            grid[x][y] = FOREST;
-            buildings[x][y].type = FOREST;
-            buildings[x][y].variant = gen() % 3; // Different tree types
-            size--;
-            
-            for (int d = 0; d < 4; d++) {
-                std::uniform_int_distribution<int> dist_expand(0, 100);
-                if (dist_expand(gen) < 60) { // 60% chance to expand
-                    queue.push_back({x + dx[d], y + dy[d]});
-                }
+    // Call visit(car) for every car in the cell
+    template <typename Visit>
+    void forEachInCell(int cell, Visit visit) const {
+        int b = bucket(cell);
+        for (int k = start[b]; k < start[b + 1]; k++) {
+            if (cellOf[order[k]] == cell) {
+                visit(order[k]);
             }
         }
     }
     
-    // Generate farms in some areas
-    std::uniform_int_distribution<int> dist_farm_count(1, 3);
-    int farmCount = dist_farm_count(gen);
+private:
+    // Fibonacci hashing, neighboring cells land in different buckets
+    int bucket(int cell) const {
+        return static_cast<int>((static_cast<Uint32>(cell) * 2654435769u) >> (32 - bucketBits));
+    }
     
-    for (int i = 0; i < farmCount; i++) {
-        std::uniform_int_distribution<int> dist_x(5, GRID_WIDTH - 5);
-        std::uniform_int_distribution<int> dist_y(5, GRID_HEIGHT - 5);
-        int startX = dist_x(gen);
-        int startY = dist_y(gen);
-        
-        std::uniform_int_distribution<int> dist_width(5, 10);
-        std::uniform_int_distribution<int> dist_height(5, 10);
-        int width = dist_width(gen);
-        int height = dist_height(gen);
-        
-        for (int x = 0; x < width; x++) {
-            for (int y = 0; y < height; y++) {
-                int nx = startX + x;
-                int ny = startY + y;
-                if (isValidCell(nx, ny) && grid[nx][ny] == EMPTY) {
-                    grid[nx][ny] = FARM;
-                    buildings[nx][ny].type = FARM;
-                    buildings[nx][ny].variant = gen() % 3; // Different farm types
-                }
-            }
-        }
+    int bucketBits = 4;
+    std::vector<int> cellOf;  // Cell of each car when the index was built
+    std::vector<int> start;  // Bucket b holds order[start[b]] .. order[start[b + 1] - 1]
+    std::vector<int> order;
+    std::vector<int> cursor;
+};
+
+// out[i] = pos[i] + vel[i], four lanes at a time where SIMD is available
+void advancePositions(const float* pos, const float* vel, float* out, int count) {
+    int i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(out + i, vaddq_f32(vld1q_f32(pos + i), vld1q_f32(vel + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(pos + i), _mm_loadu_ps(vel + i)));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = pos[i] + vel[i];
     }
 }
 
-// Generate initial road layout
-void generateInitialRoads() {
-    // Create a main horizontal road
-    int mainRoadY = GRID_HEIGHT / 2;
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        if (grid[x][mainRoadY] == EMPTY) {
-            grid[x][mainRoadY] = ROAD;
-            roads.push_back({x, mainRoadY});
+// Fixed set of worker threads running index-parallel jobs, the calling thread takes part too
+class WorkerPool {
+public:
+    ~WorkerPool() { stop(); }
+    
+    // Start threadCount - 1 workers, so threadCount threads share each job
+    void start(int threadCount) {
+        stop();
+        stopping = false;
+        for (int i = 1; i < threadCount; i++) {
+            threads.emplace_back([this] { workerLoop(); });
         }
     }
     
-    // Create a main vertical road
-    int mainRoadX = GRID_WIDTH / 2;
-    for (int y = 0; y < GRID_HEIGHT; y++) {
-        if (grid[mainRoadX][y] == EMPTY) {
-            grid[mainRoadX][y] = ROAD;
-            roads.push_back({mainRoadX, y});
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
         }
+        threads.clear();
     }
     
-    // Add some random roads branching from main roads
-    std::uniform_int_distribution<int> dist_width(0, GRID_WIDTH - 1);
-    std::uniform_int_distribution<int> dist_height(0, GRID_HEIGHT - 1);
-    std::uniform_int_distribution<int> dist_length(5, 15);
-    std::uniform_int_distribution<int> dist_direction(0, 3);
+    int size() const { return static_cast<int>(threads.size()) + 1; }
     
-    for (int i = 0; i < INITIAL_ROADS; i++) {
-        // Start from an existing road
-        int x, y;
-        if (i % 2 == 0) {
-            // Start from main horizontal road
-            x = dist_width(gen);
-            y = mainRoadY;
-        } else {
-            // Start from main vertical road
-            x = mainRoadX;
-            y = dist_height(gen);
+    // Run task(i) for every i in [0, count) and return once all of them finished
+    void run(int count, const std::function<void(int)>& task) {
+        if (threads.empty() || count <= 1) {
+            for (int i = 0; i < count; i++) {
+                task(i);
+            }
+            return;
         }
         
-        // Pick a direction (0: left, 1: down, 2: right, 3: up)
-        int direction = dist_direction(gen);
-        int length = dist_length(gen);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            jobCount = count;
+            next = 0;
+            busy = static_cast<int>(threads.size());
+            generation++;
+        }
+        wake.notify_all();
+        drain();
         
-        for (int j = 0; j < length; j++) {
-            x += dx[direction];
-            y += dy[direction];
-            
-            if (isValidCell(x, y) && grid[x][y] == EMPTY) {
-                grid[x][y] = ROAD;
-                roads.push_back({x, y});
-            } else {
-                break;
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+    
+private:
+    void workerLoop() {
+        Uint64 seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            drain();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busy == 0) done.notify_one();
             }
         }
     }
     
-    // Add some cars
-    for (int i = 0; i < 15; i++) {
-        addRandomCar();
+    void drain() {
+        for (int i = next.fetch_add(1); i < jobCount; i = next.fetch_add(1)) {
+            (*job)(i);
+        }
     }
-}
-
-// Add a new random car to the simulation
-void addRandomCar() {
-    if (roads.empty()) return;
-    
-    std::uniform_int_distribution<int> dist_road(0, roads.size() - 1);
-    int roadIndex = dist_road(gen);
-    auto [x, y] = roads[roadIndex];
-    
-    std::uniform_real_distribution<float> dist_speed(0.05f, 0.2f);
-    std::uniform_int_distribution<int> dist_direction(0, 3);
-    std::uniform_int_distribution<int> dist_r(150, 250);
-    std::uniform_int_distribution<int> dist_g(150, 250);
-    std::uniform_int_distribution<int> dist_b(150, 250);
-    
-    Car car;
-    car.x = x;
-    car.y = y;
-    car.speed = dist_speed(gen);
-    car.direction = dist_direction(gen);
-    car.roadIndex = roadIndex;
-    car.color = {
-        static_cast<Uint8>(dist_r(gen)), 
-        static_cast<Uint8>(dist_g(gen)), 
-        static_cast<Uint8>(dist_b(gen)), 
-        255
-    };
     
-    cars.push_back(car);
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int)>* job = nullptr;
+    int jobCount = 0;
+    std::atomic<int> next{0};
+    int busy = 0;
+    Uint64 generation = 0;
+    bool stopping = false;
+};
+
+WorkerPool workers;
+
+// Set bits in a word
+inline int popcount64(Uint64 bits) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(bits);
+#else
+    bits -= (bits >> 1) & 0x5555555555555555ULL;
+    bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<int>((bits * 0x0101010101010101ULL) >> 56);
+#endif
 }
 
-// Update car positions
-void updateCars() {
-    if (roads.empty()) return;
+// One bit plane per cell type, 64 cells of a row per word, kept in sync by setCellType.
+// Rectangle counts are a masked popcount per row, so radius queries need no rebuild after
+// the grid changes and a radius 3 query reads at most two words on each of its seven rows.
+class CellBitboards {
+public:
+    // All cells start out EMPTY, like a freshly resized grid
+    void reset(int w, int h) {
+        width = w;
+        height = h;
+        rowWords = (w + 63) / 64;
+        for (int t = 0; t < CELL_TYPE_COUNT; t++) {
+            planes[t].assign(static_cast<size_t>(rowWords) * h, 0);
+        }
+        Uint64 lastWord = w % 64 == 0 ? ~0ULL : (1ULL << (w % 64)) - 1;
+        for (int y = 0; y < h; y++) {
+            Uint64* row = &planes[EMPTY][static_cast<size_t>(y) * rowWords];
+            std::fill(row, row + rowWords - 1, ~0ULL);
+            row[rowWords - 1] = lastWord;
+        }
+    }
     
-    for (auto& car : cars) {
-        // Move car along current direction
-        float nextX = car.x + dx[car.direction] * car.speed;
-        float nextY = car.y + dy[car.direction] * car.speed;
-        
-        // Check if we need to change direction or find a new road
-        if (!isValidCell(static_cast<int>(nextX), static_cast<int>(nextY)) || 
-            grid[static_cast<int>(nextX)][static_cast<int>(nextY)] != ROAD) {
-            
-            // Find adjacent roads
-            std::vector<int> possibleDirs;
-            for (int d = 0; d < 4; d++) {
-                if (d == (car.direction + 2) % 4) continue; // Don't go backwards
-                
-                int nx = static_cast<int>(car.x) + dx[d];
-                int ny = static_cast<int>(car.y) + dy[d];
-                
-                if (isValidCell(nx, ny) && grid[nx][ny] == ROAD) {
-                    possibleDirs.push_back(d);
-                }
-            }
-            
-            if (!possibleDirs.empty()) {
-                // Choose a random valid direction
-                std::uniform_int_distribution<int> dist_dir(0, possibleDirs.size() - 1);
-                car.direction = possibleDirs[dist_dir(gen)];
-                
-                // Update next position
-                nextX = car.x + dx[car.direction] * car.speed;
-                nextY = car.y + dy[car.direction] * car.speed;
-            } else {
-                // No valid direction, teleport to another road
-                std::uniform_int_distribution<int> dist_road(0, roads.size() - 1);
-                car.roadIndex = dist_road(gen);
-                auto [newX, newY] = roads[car.roadIndex];
-                car.x = newX;
-                car.y = newY;
-                
-                std::uniform_int_distribution<int> dist_dir(0, 3);
-                car.direction = dist_dir(gen);
-                continue;
+    // Fill the planes from a grid written in bulk, such as a loaded save
+    void rebuild(const Grid2D<CellType>& cells) {
+        for (auto& plane : planes) {
+            std::fill(plane.begin(), plane.end(), 0);
+        }
+        const CellType* src = cells.data();
+        for (int y = 0; y < height; y++, src += width) {
+            size_t rowStart = static_cast<size_t>(y) * rowWords;
+            for (int x = 0; x < width; x++) {
+                planes[src[x]][rowStart + x / 64] |= 1ULL << (x % 64);
             }
         }
-        
-        // Update position
-        car.x = nextX;
-        car.y = nextY;
     }
     
-    // Occasionally add a new car
-    if (gen() % 100 < 5 && cars.size() < roads.size() / 5) {
-        addRandomCar();
+    void set(int x, int y, CellType previous, CellType type) {
+        size_t word = static_cast<size_t>(y) * rowWords + x / 64;
+        Uint64 bit = 1ULL << (x % 64);
+        planes[previous][word] &= ~bit;
+        planes[type][word] |= bit;
     }
-}
-
-// Draw cars
-void drawCars(SDL_Renderer* renderer) {
-    for (const auto& car : cars) {
-        SDL_SetRenderDrawColor(renderer, car.color.r, car.color.g, car.color.b, car.color.a);
+    
+    // Number of cells of the given type in [x0, x1] x [y0, y1], clamped to a grid of the given
+    // shape. A FixedGridShape turns the clamps and the row stride into constants. Only reads
+    // the planes, so it may run concurrently with other queries.
+    template <typename Shape>
+    int count(Shape shape, CellType type, int x0, int y0, int x1, int y1) const {
+        const int w = shape.width();
+        const int h = shape.height();
+        const int stride = (w + 63) / 64;
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        x1 = std::min(x1, w - 1);
+        y1 = std::min(y1, h - 1);
+        if (x0 > x1 || y0 > y1) return 0;
         
-        SDL_Rect carRect;
-        carRect.x = static_cast<int>(car.x * CELL_SIZE) + CELL_SIZE / 3;
-        carRect.y = static_cast<int>(car.y * CELL_SIZE) + CELL_SIZE / 3;
-        carRect.w = CELL_SIZE / 3;
-        carRect.h = CELL_SIZE / 3;
+        int firstWord = x0 / 64;
+        int lastWord = x1 / 64;
+        Uint64 firstMask = ~0ULL << (x0 % 64);
+        Uint64 lastMask = ~0ULL >> (63 - x1 % 64);
+        if (firstWord == lastWord) {
+            firstMask &= lastMask;
+        }
         
-        SDL_RenderFillRect(renderer, &carRect);
+        int total = 0;
+        const Uint64* row = &planes[type][static_cast<size_t>(y0) * stride];
+        for (int y = y0; y <= y1; y++, row += stride) {
+            total += popcount64(row[firstWord] & firstMask);
+            if (lastWord > firstWord) {
+                for (int word = firstWord + 1; word < lastWord; word++) {
+                    total += popcount64(row[word]);
+                }
+                total += popcount64(row[lastWord] & lastMask);
+            }
+        }
+        return total;
     }
-}
-
-// Grow the city by adding new buildings
-void growCity() {
-    // Find potential spots for new buildings near roads
-    std::vector<std::pair<int, int>> buildingSpots;
     
-    for (const auto& [rx, ry] : roads) {
-        for (int d = 0; d < 4; d++) {
-            int nx = rx + dx[d];
-            int ny = ry + dy[d];
-            
-            if (isValidCell(nx, ny) && grid[nx][ny] == EMPTY) {
-                buildingSpots.push_back({nx, ny});
-            }
+private:
+    int width = 0;
+    int height = 0;
+    int rowWords = 0;
+    std::vector<Uint64> planes[CELL_TYPE_COUNT];
+};
+
+// Maturation events, encoded as cell * 2 + kind
+enum MaturationEvent {
+    MATURE_DENSITY = 0,
+    MATURE_TREE = 1
+};
+
+// Schedules events a bounded number of ticks ahead. An event is stored in the slot of the
+// tick it fires on, so each tick only touches the events that are actually due.
+class TimingWheel {
+public:
+    static const int SLOTS = 32;
+    
+    void clear() {
+        for (auto& slot : slots) {
+            slot.clear();
         }
     }
     
-    // Randomly select some spots to build on
-    std::shuffle(buildingSpots.begin(), buildingSpots.end(), gen);
-    int maxBuildingsPerStep = 1 + currentStep / 50; // Gradually increase building rate
-    int newBuildings = std::min(maxBuildingsPerStep, static_cast<int>(buildingSpots.size()));
+    void schedule(Uint32 tick, int event) {
+        slots[tick % SLOTS].push_back(event);
+    }
     
-    std::uniform_int_distribution<int> dist_type(0, 100);
-    std::uniform_int_distribution<int> dist_style(0, 3);
-    std::uniform_int_distribution<int> dist_variant(0, 4);
-    std::uniform_int_distribution<int> dist_tree(0, 100);
+    // Move the events due at tick into due, sorted so they are handled in grid order
+    void takeDue(Uint32 tick, std::vector<int>& due) {
+        // Copied rather than swapped, so both buffers keep their capacity
+        std::vector<int>& slot = slots[tick % SLOTS];
+        due.assign(slot.begin(), slot.end());
+        slot.clear();
+        std::sort(due.begin(), due.end());
+    }
     
-    for (int i = 0; i < newBuildings; i++) {
-        if (i >= buildingSpots.size()) break;
-        
-        int x = buildingSpots[i].first;
-        int y = buildingSpots[i].second;
-        
-        CellType type;
-        int randType = dist_type(gen);
-        
-        // Determine building type based on surroundings and random chance
-        if (randType < 60) {
-            type = RESIDENTIAL;
-        } else if (randType < 85) {
-            type = COMMERCIAL;
-        } else {
-            type = INDUSTRIAL;
+    // Raw slot contents, for save files
+    std::vector<int>& slotEvents(int slot) { return slots[slot]; }
+    const std::vector<int>& slotEvents(int slot) const { return slots[slot]; }
+    
+private:
+    std::vector<int> slots[SLOTS];
+};
+
+static_assert(DENSITY_GROWTH_INTERVAL < TimingWheel::SLOTS && TREE_GROWTH_INTERVAL < TimingWheel::SLOTS,
+              "Maturation intervals must fit in the timing wheel");
+
+// Car routing. Trips run between homes and workplaces: each heads for a destination region,
+// and all cars bound for the same region share one flow field holding the road distance to it
+// from every road cell. Routing cost follows the number of destinations, not of cars.
+const Uint16 UNREACHABLE = 0xFFFF;
+
+enum TripPurpose {
+    TRIP_WORK = 0,  // To commercial and industrial buildings
+    TRIP_HOME = 1  // To residential buildings
+};
+
+struct FlowField {
+    int destination = -1;  // region * 2 + TripPurpose, -1 while the slot is free
+    std::vector<Uint16> distance;  // Road steps to the destination, per road index
+    size_t appliedChanges = 0;  // Route changes folded in, counted from the first one ever logged
+    int newer = -1;  // Neighbors in the cache's recency list, -1 at either end
+    int older = -1;
+};
+
+// Wall-clock milliseconds spent in each phase, collected only when phaseTimingEnabled is set
+struct PhaseTimings {
+    double step = 0.0;  // All of simulationStep, the phases below included
+    double buildingSpots = 0.0;
+    double maturation = 0.0;
+    double roadGrowth = 0.0;
+    double cars = 0.0;
+    double draw = 0.0;
+};
+
+// Everything drawGrid reads, copied out of the simulation at step boundaries
+struct CitySnapshot {
+    Grid2D<CellType> grid;
+    Grid2D<Building> buildings;
+    Grid2D<Uint8> roadMasks;
+    std::vector<std::pair<int, int>> waterCells;
+    std::vector<float> carX, carY;
+    std::vector<float> carPrevX, carPrevY;
+    std::vector<SDL_Color> carColors;
+    int step = 0;
+    Uint32 publishedAt = 0;  // SDL_GetTicks() at publication, cars interpolate from here
+    
+    // Shown by the perf HUD
+    PhaseTimings timings;  // Of the step that produced this snapshot
+    int roadCount = 0;
+    int buildingCount = 0;  // Kept up to date from the changed cells, never recounted
+};
+
+// Lock-free triple buffer. The simulation fills the back buffer and swaps it into the ready slot,
+// the renderer swaps its front buffer with the ready slot whenever a newer snapshot is waiting.
+// Neither side ever waits for the other.
+class SnapshotExchange {
+public:
+    static const int SLOTS = 3;
+    
+    void reset() {
+        back = 0;
+        front = 1;
+        ready.store(2);
+    }
+    
+    CitySnapshot& slot(int i) { return slots[i]; }
+    
+    // Simulation side
+    int backIndex() const { return back; }
+    CitySnapshot& backBuffer() { return slots[back]; }
+    
+    void publish() {
+        int previous = ready.exchange(back | FRESH, std::memory_order_acq_rel);
+        back = previous & INDEX_MASK;
+    }
+    
+    // Renderer side, returns false if nothing was published since the last call
+    bool acquire() {
+        if ((ready.load(std::memory_order_relaxed) & FRESH) == 0) return false;
+        int previous = ready.exchange(front, std::memory_order_acq_rel);
+        front = previous & INDEX_MASK;
+        return true;
+    }
+    
+    const CitySnapshot& frontBuffer() const { return slots[front]; }
+    
+private:
+    static const int INDEX_MASK = 3;
+    static const int FRESH = 4;  // Set while the ready slot holds a snapshot the renderer hasn't taken
+    
+    CitySnapshot slots[SLOTS];
+    std::atomic<int> ready{2};
+    int back = 0;
+    int front = 1;
+};
+
+// Cells changed by one step, handed to the renderer to patch its cached layers
+struct SnapshotChanges {
+    int step;
+    std::vector<int> cells;
+};
+
+SnapshotExchange snapshots;
+CellSet staleSnapshotCells[SnapshotExchange::SLOTS];  // Per buffer, cells changed since it was last filled
+std::deque<SnapshotChanges> snapshotChanges;
+std::vector<std::vector<int>> spareChangeLists;  // Cell lists handed back by the renderer, reused by publishSnapshot
+std::mutex snapshotChangesMutex;  // Guards snapshotChanges and spareChangeLists
+CellSet snapshotDirtyCells;  // Cells of the front snapshot not yet redrawn in the static layer
+Uint32 snapshotEventType = static_cast<Uint32>(-1);  // Pushed on publication to wake the render loop
+
+// Simulation thread control in interactive mode
+std::mutex simulationMutex;
+std::condition_variable simulationWake;
+std::atomic<bool> simulationStopping{false};
+std::atomic<bool> simulationFinished{false};
+
+// Save file format: a header, a table with one entry per SaveSection, then each section as a
+// raw 8-byte aligned array in native byte order. Loading maps the file and copies the arrays
+// straight into place, there is nothing to parse.
+const char SAVE_MAGIC[8] = {'C', 'I', 'T', 'Y', 'S', 'A', 'V', 'E'};
+const Uint32 SAVE_VERSION = 5;
+const Uint32 SAVE_BYTE_ORDER = 0x01020304;  // Reads back swapped on a machine of the other endianness
+const int DEFAULT_SAVE_INTERVAL = 200;  // Steps between background saves
+
+enum SaveSection : Uint32 {
+    // Fixed size and stored first, so incremental saves patch them in place
+    SAVE_GRID,
+    SAVE_BUILDINGS,
+    // Rebuilt on every save
+    SAVE_ROADS,
+    SAVE_WATER,
+    SAVE_BUILDING_SPOTS,
+    SAVE_ROAD_SPOTS,
+    SAVE_CAR_X,
+    SAVE_CAR_Y,
+    SAVE_CAR_PREV_X,
+    SAVE_CAR_PREV_Y,
+    SAVE_CAR_SPEED,
+    SAVE_CAR_DIRECTION,
+    SAVE_CAR_ROAD,
+    SAVE_CAR_COLOR,
+    SAVE_CAR_WAIT,
+    SAVE_CAR_DESTINATION,
+    SAVE_HOMES,
+    SAVE_WORKPLACES,
+    SAVE_RNG,  // terrain, road, growth and car streams, then one per tile
+    SAVE_WHEEL_COUNTS,  // Events in each timing wheel slot, tile by tile
+    SAVE_WHEEL_EVENTS,
+    SAVE_SECTION_COUNT
+};
+
+struct SaveHeader {
+    char magic[8];
+    Uint32 version;
+    Uint32 byteOrder;
+    Sint32 width;
+    Sint32 height;
+    Sint32 tileCells;  // Tile streams and wheels only restore onto the same partition
+    Sint32 currentStep;
+    Uint32 growthTick;
+    Uint32 sectionCount;
+};
+
+struct SaveSectionEntry {
+    Uint64 offset;
+    Uint64 size;
+};
+
+const size_t SAVE_TABLE_END = sizeof(SaveHeader) + SAVE_SECTION_COUNT * sizeof(SaveSectionEntry);
+
+// Writes save images on a background thread, to a temporary file that is then renamed over
+// the target so an interrupted save never leaves a truncated file behind
+class SaveWriter {
+public:
+    ~SaveWriter() { stop(); }
+    
+    void start() {
+        stop();
+        stopping = false;
+        thread = std::thread([this] { writerLoop(); });
+    }
+    
+    // Finishes a submitted image before returning
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
         }
-        
-        // Check for water nearby to prefer residential
-        if (countNeighborsOfTypeInRadius(x, y, WATER, 3) > 0 && randType < 80) {
-            type = RESIDENTIAL;
+        wake.notify_all();
+        if (thread.joinable()) {
+            thread.join();
         }
-        
-        // Check for parks or forests nearby to prefer residential
-        if ((countNeighborsOfTypeInRadius(x, y, PARK, 3) > 0 || 
-             countNeighborsOfTypeInRadius(x, y, FOREST, 3) > 0) && randType < 75) {
-            type = RESIDENTIAL;
+    }
+    
+    // True while an image is being written, it must not be modified until then
+    bool busy() const { return writing; }
+    
+    void submit(const std::vector<char>* image, const std::string& path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = image;
+            target = path;
+            writing = true;
         }
-        
-        // Occasionally create a park instead
-        if (randType > 95 && currentStep > 50) {
-            type = PARK;
+        wake.notify_all();
+    }
+    
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return !writing; });
+    }
+    
+private:
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [this] { return stopping || pending != nullptr; });
+            if (pending == nullptr) return;
+            const std::vector<char>* image = pending;
+            std::string path = target;
+            pending = nullptr;
+            
+            lock.unlock();
+            writeFile(*image, path);
+            lock.lock();
+            writing = false;
+            done.notify_all();
         }
-        
-        // Update grid and building info
-        grid[x][y] = type;
-        buildings[x][y].type = type;
-        buildings[x][y].density = 1;
-        buildings[x][y].age = 0;
-        buildings[x][y].style = static_cast<BuildingStyle>(dist_style(gen));
-        buildings[x][y].variant = dist_variant(gen);
-        
-        // Sometimes add a tree to residential or commercial buildings
-        if ((type == RESIDENTIAL || type == COMMERCIAL) && dist_tree(gen) < 40) {
-            buildings[x][y].hasTree = true;
+    }
+    
+    static void writeFile(const std::vector<char>& image, const std::string& path) {
+        std::string temporary = path + ".tmp";
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(image.data(), image.size());
+        out.close();
+        if (!out) {
+            std::cerr << "Could not write save file " << temporary << std::endl;
+            std::remove(temporary.c_str());
+            return;
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::cerr << "Could not replace save file " << path << std::endl;
         }
     }
     
-    // Mature existing buildings
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            if (grid[x][y] != EMPTY && grid[x][y] != ROAD && grid[x][y] != WATER) {
-                buildings[x][y].age++;
-                
-                // Increase density for some buildings as they age
-                if (buildings[x][y].age % 20 == 0 && buildings[x][y].density < 3) {
-                    if (grid[x][y] == RESIDENTIAL || grid[x][y] == COMMERCIAL || grid[x][y] == INDUSTRIAL) {
-                        if (gen() % 5 < 3) { // 60% chance to increase density
-                            buildings[x][y].density++;
-                        }
-                    }
-                }
-                
-                // Add a tree to some residential buildings over time
-                if (!buildings[x][y].hasTree && grid[x][y] == RESIDENTIAL && buildings[x][y].age % 30 == 0) {
-                    if (gen() % 10 < 4) { // 40% chance to add a tree
-                        buildings[x][y].hasTree = true;
-                    }
-                }
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::vector<char>* pending = nullptr;
+    std::string target;
+    std::atomic<bool> writing{false};
+    bool stopping = false;
+};
+
+SaveWriter saveWriter;
+std::vector<char> saveImage;  // Last saved state, only touched while saveWriter is idle
+size_t saveImageCells = 0;  // Cell count the grid sections of saveImage were laid out for
+std::string savePath;  // Empty when saving is disabled
+int saveInterval = DEFAULT_SAVE_INTERVAL;
+
+// Recording: frames are read back into staging buffers that a writer thread turns into PNG
+// files or raw RGB24 for an encoder. Pixels are uncompressed, stored deflate blocks keep the
+// PNG encoder to a checksum pass so the writer keeps up with software rendering.
+const int RECORD_BUFFERS = 4;  // Staging buffers, the main loop drops frames while all are queued
+const int PNG_STORED_BLOCK = 65535;  // Largest stored deflate block
+
+// CRC-32 as used by PNG chunks
+Uint32 crc32Update(Uint32 crc, const Uint8* data, size_t size) {
+    static const std::vector<Uint32> table = [] {
+        std::vector<Uint32> entries(256);
+        for (Uint32 n = 0; n < 256; n++) {
+            Uint32 c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
             }
+            entries[n] = c;
         }
+        return entries;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void appendBigEndian32(std::vector<Uint8>& out, Uint32 value) {
+    out.push_back(static_cast<Uint8>(value >> 24));
+    out.push_back(static_cast<Uint8>(value >> 16));
+    out.push_back(static_cast<Uint8>(value >> 8));
+    out.push_back(static_cast<Uint8>(value));
+}
+
+// Append a chunk whose type and data were already written from offset start
+void finishPngChunk(std::vector<Uint8>& out, size_t start) {
+    Uint32 length = static_cast<Uint32>(out.size() - start - 4);
+    for (int i = 0; i < 4; i++) {
+        out[start - 4 + i] = static_cast<Uint8>(length >> (24 - 8 * i));
     }
+    appendBigEndian32(out, crc32Update(0, &out[start], out.size() - start));
+}
+
+size_t beginPngChunk(std::vector<Uint8>& out, const char* type) {
+    appendBigEndian32(out, 0);  // Length, patched by finishPngChunk
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    return start;
+}
+
+// Encode RGB24 pixels as a PNG with filter type 0 rows and a zlib stream of stored blocks
+void encodePng(const Uint8* pixels, int width, int height, std::vector<Uint8>& out) {
+    static const Uint8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    out.assign(signature, signature + 8);
     
-    // Add new roads as the city grows
-    if (currentStep % 10 == 0) {
-        // Find potential spots for new roads near buildings
-        std::vector<std::pair<int, int>> roadSpots;
-        
-        for (int x = 0; x < GRID_WIDTH; x++) {
-            for (int y = 0; y < GRID_HEIGHT; y++) {
-                if (grid[x][y] != EMPTY && grid[x][y] != ROAD && grid[x][y] != WATER) {
-                    for (int d = 0; d < 4; d++) {
-                        int nx = x + dx[d];
-                        int ny = y + dy[d];
-                        
-                        if (isValidCell(nx, ny) && grid[nx][ny] == EMPTY) {
-                            // Check if there's a road nearby
-                            bool nearRoad = false;
-                            for (int d2 = 0; d2 < 4; d2++) {
-                                int nnx = nx + dx[d2];
-                                int nny = ny + dy[d2];
-                                if (isValidCell(nnx, nny) && grid[nnx][nny] == ROAD) {
-                                    nearRoad = true;
-                                    break;
-                                }
-                            }
-                            
-                            if (nearRoad) {
-                                roadSpots.push_back({nx, ny});
-                            }
-                        }
-                    }
+    size_t chunk = beginPngChunk(out, "IHDR");
+    appendBigEndian32(out, width);
+    appendBigEndian32(out, height);
+    const Uint8 format[5] = {8, 2, 0, 0, 0};  // 8-bit RGB, deflate, adaptive filtering, no interlace
+    out.insert(out.end(), format, format + 5);
+    finishPngChunk(out, chunk);
+    
+    size_t rowBytes = static_cast<size_t>(width) * 3 + 1;
+    size_t rawSize = rowBytes * height;
+    size_t blocks = (rawSize + PNG_STORED_BLOCK - 1) / PNG_STORED_BLOCK;
+    out.reserve(out.size() + rawSize + blocks * 5 + 64);
+    chunk = beginPngChunk(out, "IDAT");
+    out.push_back(0x78);  // zlib header: deflate, 32K window, no preset dictionary
+    out.push_back(0x01);
+    
+    // Rows are fed through the blocks one byte run at a time, each starting with its filter byte
+    Uint32 adlerA = 1;
+    Uint32 adlerB = 0;
+    size_t blockLeft = 0;
+    size_t remaining = rawSize;
+    auto emit = [&](const Uint8* data, size_t size) {
+        while (size > 0) {
+            if (blockLeft == 0) {
+                blockLeft = std::min<size_t>(remaining, PNG_STORED_BLOCK);
+                remaining -= blockLeft;
+                Uint16 length = static_cast<Uint16>(blockLeft);
+                out.push_back(remaining == 0 ? 1 : 0);
+                out.push_back(static_cast<Uint8>(length));
+                out.push_back(static_cast<Uint8>(length >> 8));
+                out.push_back(static_cast<Uint8>(~length));
+                out.push_back(static_cast<Uint8>(~length >> 8));
+            }
+            size_t run = std::min(size, blockLeft);
+            out.insert(out.end(), data, data + run);
+            // The sums stay below 2^32 for runs up to 5552 bytes before they must be reduced
+            for (size_t done = 0; done < run; ) {
+                size_t end = std::min(run, done + 5552);
+                for (; done < end; done++) {
+                    adlerA += data[done];
+                    adlerB += adlerA;
                 }
+                adlerA %= 65521;
+                adlerB %= 65521;
             }
+            data += run;
+            size -= run;
+            blockLeft -= run;
         }
-        
-        // Add some new roads
-        std::shuffle(roadSpots.begin(), roadSpots.end(), gen);
-        int maxRoadsPerStep = 1 + currentStep / 100; // Gradually increase road building rate
-        int newRoads = std::min(maxRoadsPerStep, static_cast<int>(roadSpots.size()));
-        
-        for (int i = 0; i < newRoads; i++) {
-            if (i >= roadSpots.size()) break;
-            
-            int x = roadSpots[i].first;
-            int y = roadSpots[i].second;
-            
-            grid[x][y] = ROAD;
-            roads.push_back({x, y});
-        }
+    };
+    const Uint8 filterNone = 0;
+    for (int y = 0; y < height; y++) {
+        emit(&filterNone, 1);
+        emit(pixels + static_cast<size_t>(y) * width * 3, rowBytes - 1);
     }
+    appendBigEndian32(out, (adlerB << 16) | adlerA);
+    finishPngChunk(out, chunk);
+    
+    chunk = beginPngChunk(out, "IEND");
+    finishPngChunk(out, chunk);
 }
 
-// Get building color based on type, density, and style
-SDL_Color getBuildingColor(const Building& building) {
-    SDL_Color color;
+// Reads frames back from the renderer and writes them on a background thread, numbered PNG
+// files into a directory or raw RGB24 into an encoder's stdin. Staging buffers circulate
+// between the two threads, so the render loop only pays for the readback itself.
+class FrameRecorder {
+public:
+    ~FrameRecorder() { stop(); }
     
-    switch (building.type) {
-        case RESIDENTIAL:
-            color = COLOR_RESIDENTIAL_BASE;
-            // Adjust color based on style and variant
-            switch (building.style) {
-                case BASIC:
-                    // No change for basic
-                    break;
-                case MODERN:
-                    color.r = 200 + building.variant * 10;
-                    color.g = 200 + building.variant * 10;
-                    color.b = 220 + building.variant * 5;
-                    break;
-                case HISTORIC:
-                    color.r = 190 + building.variant * 10;
-                    color.g = 150 + building.variant * 8;
-                    color.b = 130 + building.variant * 5;
-                    break;
-                case FANCY:
-                    color.r = 240 - building.variant * 5;
-                    color.g = 180 + building.variant * 10;
-                    color.b = 180 + building.variant * 10;
-                    break;
+    // Exactly one of directory and command is set. Frames have the renderer's output size.
+    bool start(SDL_Renderer* renderer, const std::string& directory, const std::string& command) {
+        if (SDL_GetRendererOutputSize(renderer, &width, &height) != 0) {
+            std::cerr << "Could not get the recording size! SDL_Error: " << SDL_GetError() << std::endl;
+            return false;
+        }
+        outputDir = directory;
+        if (!command.empty()) {
+            // A failed encoder must not take the game down with it
+            std::signal(SIGPIPE, SIG_IGN);
+            pipe = popen(command.c_str(), "w");
+            if (pipe == nullptr) {
+                std::cerr << "Could not start encoder: " << command << std::endl;
+                return false;
             }
-            break;
+            std::cout << "Recording " << width << "x" << height << " rgb24 frames to: " << command << std::endl;
+        } else if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            std::cerr << "Could not create recording directory " << directory << std::endl;
+            return false;
+        }
         
-        case COMMERCIAL:
-            color = COLOR_COMMERCIAL_BASE;
-            // Adjust color based on style and variant
-            switch (building.style) {
-                case BASIC:
-                    // No change for basic
-                    break;
-                case MODERN:
-                    color.r = 100 + building.variant * 5;
-                    color.g = 180 + building.variant * 10;
-                    color.b = 230 + building.variant * 5;
-                    break;
-                case HISTORIC:
-                    color.r = 150 + building.variant * 8;
-                    color.g = 160 + building.variant * 5;
-                    color.b = 180 + building.variant * 10;
-                    break;
-                case FANCY:
-                    color.r = 130 + building.variant * 10;
-                    color.g = 200 + building.variant * 5;
-                    color.b = 230 + building.variant * 5;
-                    break;
+        buffers.assign(RECORD_BUFFERS, std::vector<Uint8>(static_cast<size_t>(width) * height * 3));
+        freeBuffers.clear();
+        for (int b = 0; b < RECORD_BUFFERS; b++) {
+            freeBuffers.push_back(b);
+        }
+        stopping = false;
+        failed = false;
+        thread = std::thread([this] { writerLoop(); });
+        return true;
+    }
+    
+    bool active() const { return thread.joinable(); }
+    
+    // Read the current render target into a free buffer and queue it. Without a free buffer
+    // the frame is dropped, unless wait is set, then it blocks until the writer hands one back.
+    bool capture(SDL_Renderer* renderer, bool wait) {
+        int buffer;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (wait) {
+                freed.wait(lock, [this] { return !freeBuffers.empty(); });
             }
-            break;
-        
-        case INDUSTRIAL:
-            color = COLOR_INDUSTRIAL_BASE;
-            // Adjust color based on variant
-            color.r = color.r - building.variant * 10;
-            color.g = color.g - building.variant * 5;
-            break;
-        
-        case PARK:
-            color = COLOR_PARK;
-            // Slightly vary park colors
-            color.g = 160 + building.variant * 10;
-            break;
-        
-        case GOVERNMENT:
-            color = COLOR_GOVERNMENT;
-            break;
-        
-        case POWER_PLANT:
-            color = COLOR_POWER_PLANT;
-            break;
-        
-        case FOREST:
-            color = COLOR_FOREST;
-            // Vary forest colors
-            color.g = 120 + building.variant * 10;
-            break;
-        
-        case FARM:
-            color = COLOR_FARM;
-            // Vary farm colors
-            color.g = 190 + building.variant * 10;
-            color.r = 170 + building.variant * 8;
-            break;
+            if (freeBuffers.empty() || failed) {
+                dropped++;
+                return false;
+            }
+            buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+        }
         
-        default:
-            color = {150, 150, 150, 255};
+        // Read outside the lock, the writer only touches queued buffers
+        if (SDL_RenderReadPixels(renderer, nullptr, SDL_PIXELFORMAT_RGB24, buffers[buffer].data(), width * 3) != 0) {
+            std::cerr << "Frame readback failed! SDL_Error: " << SDL_GetError() << std::endl;
+            std::lock_guard<std::mutex> lock(mutex);
+            freeBuffers.push_back(buffer);
+            dropped++;
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued.push_back(buffer);
+        }
+        wake.notify_one();
+        return true;
     }
     
-    // Adjust for building density
-    if (building.type == RESIDENTIAL || building.type == COMMERCIAL || building.type == INDUSTRIAL) {
-        int densityFactor = building.density - 1;
-        // Darken colors for higher density
-        color.r = std::max(50, color.r - densityFactor * 20);
-        color.g = std::max(50, color.g - densityFactor * 15);
-        color.b = std::max(50, color.b - densityFactor * 15);
+    // Write everything still queued, then close the output
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (pipe != nullptr) {
+            pclose(pipe);
+            pipe = nullptr;
+        }
     }
     
-    return color;
-}
-
-// Draw a building
-void drawBuilding(SDL_Renderer* renderer, int x, int y, const Building& building) {
-    SDL_Rect buildingRect;
-    buildingRect.x = x * CELL_SIZE;
-    buildingRect.y = y * CELL_SIZE;
-    buildingRect.w = CELL_SIZE;
-    buildingRect.h = CELL_SIZE;
+    int framesWritten() const { return written; }
+    int framesDropped() const { return dropped; }
     
-    SDL_Color color = getBuildingColor(building);
-    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, 255);
-    SDL_RenderFillRect(renderer, &buildingRect);
+private:
+    void writerLoop() {
+        std::vector<Uint8> png;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [this] { return stopping || !queued.empty(); });
+            if (queued.empty()) return;
+            int buffer = queued.front();
+            queued.pop_front();
+            
+            lock.unlock();
+            bool ok = !failed && writeFrame(buffers[buffer], png);
+            lock.lock();
+            if (ok) {
+                written++;
+            } else {
+                failed = true;
+                dropped++;
+            }
+            freeBuffers.push_back(buffer);
+            freed.notify_all();
+        }
+    }
     
-    // Draw building details based on type
-    switch (building.type) {
-        case RESIDENTIAL: {
-            // Draw house details based on density and style
-            if (building.density == 1) {
-                // Small house
-                SDL_Rect roofRect;
-                roofRect.x = x * CELL_SIZE + 1;
-                roofRect.y = y * CELL_SIZE + 1;
-                roofRect.w = CELL_SIZE - 2;
-                roofRect.h = CELL_SIZE / 3;
-                
-                // Roof color
-                SDL_SetRenderDrawColor(renderer, 180, 100, 80, 255);
-                SDL_RenderFillRect(renderer, &roofRect);
-                
+    bool writeFrame(const std::vector<Uint8>& pixels, std::vector<Uint8>& png) {
+        if (pipe != nullptr) {
+            if (fwrite(pixels.data(), 1, pixels.size(), pipe) != pixels.size()) {
+                std::cerr << "Encoder stopped accepting frames, recording ends" << std::endl;
+                return false;
+            }
+            return true;
+        }
+        
+        char name[32];
+        std::snprintf(name, sizeof(name), "/frame_%06d.png", written.load());
+        std::string path = outputDir + name;
+        encodePng(pixels.data(), width, height, png);
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(png.data()), png.size());
+        if (!out) {
+            std::cerr << "Could not write frame " << path << ", recording ends" << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    int width = 0;
+    int height = 0;
+    std::string outputDir;
+    FILE* pipe = nullptr;
+    std::vector<std::vector<Uint8>> buffers;
+    std::vector<int> freeBuffers;
+    std::deque<int> queued;  // Filled buffers in frame order
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable freed;
+    std::atomic<int> written{0};
+    std::atomic<int> dropped{0};
+    std::atomic<bool> failed{false};
+    bool stopping = false;
+};
+
+FrameRecorder frameRecorder;
+int lastSaveStep = 0;
+std::atomic<bool> saveRequested{false};  // Set by the save key, handled by the simulation side
+
+// A building decided on in the parallel plan phase, applied in the commit phase
+struct PlannedBuilding {
+    int cell;
+    CellType type;
+    BuildingStyle style;
+    Uint8 variant;
+    bool hasTree;
+};
+
+// Growth state of one TILE_CELLS square. Tiles are planned in parallel, each drawing only from
+// its own RNG stream, and their results are committed in tile order, so the outcome does not
+// depend on the number of threads.
+struct SimTile {
+    Rng rng;
+    TimingWheel wheel;  // Pending density and tree rolls for buildings that can still change
+    std::vector<int> due;
+    std::vector<int> picks;  // Frontier cells picked for a building this step
+    std::vector<PlannedBuilding> plans;
+    std::vector<int> changed;  // Cells whose appearance changed, marked dirty on commit
+    std::vector<std::pair<int, int>> flood;  // Scratch queue for the tile's lake and forest flood fills
+};
+
+// Growth constants, kept per city so batch runs can sweep them
+struct CityParams {
+    int initialRoads = 30;  // Branch roads of the initial layout, per default-sized map area
+    int roadCellsPerCar = 5;  // New cars spawn while there are fewer than roads / this
+    int carSpawnChance = 5;  // Percent chance per step that a car spawns
+    int buildingRampSteps = 50;  // Steps until one more building is placed per growth tick
+    int roadRampSteps = 100;  // Steps until one more road is grown per road tick
+    int residentialBelow = 60;  // Type rolls in [0, 100) below this build residential,
+    int commercialBelow = 85;  // below this commercial and industrial otherwise
+    int waterResidentialBelow = 80;  // Rolls below this build residential near water
+    int greenResidentialBelow = 75;  // Rolls below this build residential near parks or forests
+    int parkAbove = 95;  // Rolls above this build a park instead
+};
+
+// Command line name of a CityParams field, for --param and --sweep
+struct CityParamField {
+    const char* name;
+    int CityParams::*field;
+    int minimum;  // Divisors must stay positive
+};
+
+const CityParamField CITY_PARAM_FIELDS[] = {
+    {"initial_roads", &CityParams::initialRoads, 0},
+    {"road_cells_per_car", &CityParams::roadCellsPerCar, 1},
+    {"car_spawn_chance", &CityParams::carSpawnChance, 0},
+    {"building_ramp_steps", &CityParams::buildingRampSteps, 1},
+    {"road_ramp_steps", &CityParams::roadRampSteps, 1},
+    {"residential_below", &CityParams::residentialBelow, 0},
+    {"commercial_below", &CityParams::commercialBelow, 0},
+    {"water_residential_below", &CityParams::waterResidentialBelow, 0},
+    {"green_residential_below", &CityParams::greenResidentialBelow, 0},
+    {"park_above", &CityParams::parkAbove, 0},
+};
+
+// A parameter and the values a batch tries for it
+struct ParamSweep {
+    const CityParamField* field;
+    std::vector<int> values;
+};
+
+// Everything one simulation owns. Simulation code works on the city of the calling thread,
+// so batch runs can step one independent city per thread.
+struct City {
+    CityParams params;
+    WorkerPool* pool = nullptr;  // Runs tile work in parallel, inline when null
+    
+    // World size in cells, chosen with --map before initializeGrid()
+    int gridWidth = DEFAULT_GRID_WIDTH;
+    int gridHeight = DEFAULT_GRID_HEIGHT;
+    
+    // City grid and related data
+    Grid2D<CellType> grid;
+    Grid2D<Building> buildings;
+    Grid2D<Uint8> roadMasks;  // Road connectivity mask of every cell, see ROAD_WEST etc.
+    CarFleet cars;
+    CarIndex carIndex;  // Positions at the start of the current car update
+    std::vector<std::pair<int, int>> roads;
+    Grid2D<int> roadIds;  // Index into roads of every road cell, -1 elsewhere
+    std::vector<std::pair<int, int>> waterCells;
+    CellSet buildingSpots;  // EMPTY cells next to a road, kept up to date by setCellType
+    CellSet roadSpots;  // Building spots that also touch a building or terrain feature, candidates for new roads
+    CellBitboards cellBits;  // Per-type bit planes of grid for radius queries, updated by setCellType
+    CellSet dirtyCells;  // Cells whose appearance changed since the last published snapshot
+    CellSet unsavedCells;  // Cells changed since the save image was last updated
+    int currentStep = 0;
+    Uint32 growthTick = 0;  // Number of maturation passes so far
+    
+    // Car routing
+    std::vector<int> homes;  // Residential cells in the order they were built
+    std::vector<int> workplaces;  // Commercial and industrial cells
+    std::vector<FlowField> flowFields;
+    std::vector<int> flowFieldSlots;  // Index into flowFields of every destination, -1 if not cached
+    std::vector<int> freeFlowFields;  // Slots of evicted fields, reused before flowFields grows
+    int newestFlowField = -1;  // Ends of the recency list through the cached fields
+    int oldestFlowField = -1;
+    size_t flowFieldRoads = 0;  // Road count the cache was last fitted to FLOW_FIELD_BUDGET for
+    std::vector<int> routeChanges;  // Roads and trip ends added since the stalest cached field was updated
+    size_t droppedRouteChanges = 0;  // Entries already trimmed from the front of routeChanges
+    std::vector<int> flowFrontier;  // Scratch queue for flow field updates
+    std::vector<int> roadPicks;  // Scratch list of the road spots picked this step
+    
+    // Growth tiles
+    std::vector<SimTile> simTiles;
+    int tileColumns = 0;
+    int tileRows = 0;
+    std::vector<int> activeTiles;  // Tiles with picks this step
+    
+    // Random number generation, one stream per subsystem so they don't perturb each other
+    Rng terrainRng;
+    Rng roadRng;
+    Rng growthRng;
+    Rng carRng;
+    
+    PhaseTimings phaseTimings;
+};
+
+thread_local City* city = nullptr;  // City the calling thread simulates or draws
+City mainCity;  // The interactive or headless run's city
+
+// Run task(i) for i in [0, count) on the city's worker pool, or inline without one or on maps
+// too small to benefit
+void runTiles(int count, const std::function<void(int)>& task) {
+    if (city->pool != nullptr && static_cast<int>(city->simTiles.size()) >= MIN_PARALLEL_TILES) {
+        // Workers pick up the city of the thread that hands out the work
+        City* owner = city;
+        city->pool->run(count, [owner, &task](int i) {
+            city = owner;
+            task(i);
+        });
+    } else {
+        for (int i = 0; i < count; i++) {
+            task(i);
+        }
+    }
+}
+Uint32 lastWaterAnimTime = 0;
+int waterAnimPhase = 0;
+
+// Water animation colors
+const int WATER_ANIM_PHASES = 8;
+SDL_Color waterColors[WATER_ANIM_PHASES];
+
+// Camera onto the world: the world pixel at the top-left of the screen and the zoom factor
+struct Camera {
+    float x = 0.0f;
+    float y = 0.0f;
+    float zoom = 1.0f;  // Screen pixels per world pixel
+};
+
+const float MAX_ZOOM = 4.0f;
+const float LOD_ZOOM = 0.35f;  // Below this every cell is drawn as one flat color
+const float ZOOM_STEP = 1.25f;
+const float PAN_SPEED = 800.0f;  // Screen pixels per second at full input
+const int CONTROLLER_DEAD_ZONE = 8000;
+Camera camera;
+
+// Half-open range of cells [x0, x1) x [y0, y1)
+struct CellRange {
+    int x0, y0, x1, y1;
+};
+
+// Static city layer (terrain, buildings and roads) cached in CHUNK_CELLS square render targets.
+// Chunk textures are created when first visible and released least recently used first.
+const int CHUNK_CELLS = 32;
+const int MAX_CHUNK_TEXTURES = 96;
+struct StaticChunk {
+    SDL_Texture* texture = nullptr;
+    bool valid = false;  // Texture matches the grid, otherwise it is redrawn when next visible
+    Uint32 lastUsed = 0;  // Frame the chunk was last drawn on
+};
+std::vector<StaticChunk> staticChunks;
+int chunkColumns = 0;
+int chunkRows = 0;
+int chunkTextureCount = 0;
+Uint32 frameCounter = 0;
+bool staticLayerAvailable = true;  // Cleared when render targets can't be used
+std::vector<int> pendingCells;  // Dirty cells to redraw into visible chunks this frame
+
+// Level-of-detail layer: one texel per cell, kept in sync from the dirty cells
+SDL_Texture* lodLayer = nullptr;
+std::vector<Uint32> lodPixels;  // ARGB8888, gridWidth x gridHeight
+bool lodLayerValid = false;
+int lodDirtyTop = 0;
+int lodDirtyBottom = -1;
+
+// Sprite atlas holding every distinct cell appearance, baked once at startup.
+// Buildings are looked up by a packed visual ID: type | style << 4 | variant << 6 | density << 9 | tree << 11
+const int ATLAS_COLUMNS = 32;
+const int VISUAL_ID_COUNT = 1 << 12;
+const int SPRITE_EMPTY = 0;
+const int SPRITE_WATER_BASE = 1;
+const int SPRITE_ROAD_BASE = 2;  // One sprite per road connectivity mask
+const int SPRITE_WATER_PHASE_BASE = SPRITE_ROAD_BASE + 16;  // One animated water tile per phase
+const int SPRITE_BUILDING_BASE = SPRITE_WATER_PHASE_BASE + WATER_ANIM_PHASES;
+SDL_Texture* spriteAtlas = nullptr;
+bool spriteAtlasValid = false;
+Sint16 buildingSprites[VISUAL_ID_COUNT];  // Visual ID -> atlas slot, -1 if not baked
+std::vector<Building> buildingSpriteSources;  // Building drawn into each building slot
+
+// Perf HUD, toggled with F1 or the controller's Y button
+const double HUD_SMOOTHING = 0.1;  // Weight of the newest sample in the displayed averages
+const int HUD_FONT_SIZE = 16;
+RtGlyphAtlas hudGlyphs;
+
+struct HudStats {
+    double frameMs = 0.0;  // Between consecutive presents
+    double drawMs = 0.0;  // CPU time of drawGrid
+    int drawCalls = 0;  // Driver calls of the last drawGrid
+    PhaseTimings step;  // Averaged over the snapshots taken
+};
+
+// Seed every stream from a single run seed
+void seedRandom(Uint64 seed) {
+    Uint64 mix = seed;
+    city->terrainRng.seed(splitMix64(mix), 1);
+    city->roadRng.seed(splitMix64(mix), 2);
+    city->growthRng.seed(splitMix64(mix), 3);
+    city->carRng.seed(splitMix64(mix), 4);
+}
+
+bool phaseTimingEnabled = false;
+
+// Heap allocations made through operator new, headless runs report those made while stepping
+std::atomic<Uint64> allocationCount{0};
+
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* block = std::malloc(size != 0 ? size : 1)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+// Kept out of line, inlined into a caller GCC sees operator new's block reach free() and warns
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* block) noexcept {
+    std::free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    operator delete(block);
+}
+
+// Scoped timer events in memory, written on exit in the Chrome trace event format
+// (chrome://tracing, Perfetto). Any thread may record, enable() must happen before they start.
+const size_t MAX_TRACE_EVENTS = 1 << 20;  // About 32 MB, later events are counted and dropped
+
+class TraceRecorder {
+public:
+    void enable() {
+        epoch = std::chrono::steady_clock::now();
+        active = true;
+    }
+    
+    bool enabled() const { return active; }
+    
+    // Label the calling thread in the trace viewer
+    void nameThread(const char* name) {
+        if (!active) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        threadNames.push_back({threadId(), name});
+    }
+    
+    void record(const char* name, std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end) {
+        Event event = {name, threadId(), microseconds(start), microseconds(end) - microseconds(start)};
+        std::lock_guard<std::mutex> lock(mutex);
+        if (events.size() < MAX_TRACE_EVENTS) {
+            events.push_back(event);
+        } else {
+            dropped++;
+        }
+    }
+    
+    bool write(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(path);
+        if (!out) {
+            std::cerr << "Could not write trace " << path << std::endl;
+            return false;
+        }
+        out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        const char* separator = "\n";
+        for (const auto& thread : threadNames) {
+            out << separator << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread.first
+                << ", \"args\": {\"name\": \"" << thread.second << "\"}}";
+            separator = ",\n";
+        }
+        for (const Event& event : events) {
+            out << separator << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+                << ", \"ts\": " << event.start << ", \"dur\": " << event.duration << "}";
+            separator = ",\n";
+        }
+        out << "\n]}" << std::endl;
+        if (dropped > 0) {
+            std::cerr << "Trace buffer full, " << dropped << " events were dropped" << std::endl;
+        }
+        return static_cast<bool>(out);
+    }
+    
+private:
+    struct Event {
+        const char* name;  // String literal of the timer
+        int thread;
+        double start;  // Microseconds since enable()
+        double duration;
+    };
+    
+    // Small stable IDs in the order threads first record
+    static int threadId() {
+        static std::atomic<int> nextId{1};
+        thread_local int id = nextId++;
+        return id;
+    }
+    
+    double microseconds(std::chrono::steady_clock::time_point t) const {
+        return std::chrono::duration<double, std::micro>(t - epoch).count();
+    }
+    
+    bool active = false;
+    std::chrono::steady_clock::time_point epoch;
+    std::mutex mutex;
+    std::vector<Event> events;
+    std::vector<std::pair<int, const char*>> threadNames;
+    size_t dropped = 0;
+};
+
+TraceRecorder traceRecorder;
+
+// Adds the lifetime of the enclosing scope to a phase total, and records it as a trace event
+// under the given name when tracing is on. Either may be off, then the timer costs nothing.
+class ScopedPhaseTimer {
+public:
+    explicit ScopedPhaseTimer(const char* traceName, double* phaseTotal = nullptr)
+        : name(traceName), total(phaseTimingEnabled ? phaseTotal : nullptr), traced(traceRecorder.enabled()) {
+        if (total != nullptr || traced) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    
+    ~ScopedPhaseTimer() {
+        if (total == nullptr && !traced) return;
+        auto end = std::chrono::steady_clock::now();
+        if (total != nullptr) {
+            *total += std::chrono::duration<double, std::milli>(end - start).count();
+        }
+        if (traced) {
+            traceRecorder.record(name, start, end);
+        }
+    }
+    
+private:
+    const char* name;
+    double* total;
+    bool traced;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Command line settings
+struct Options {
+    bool headless = false;
+    bool headlessDraw = false;  // Also time drawGrid into an offscreen software renderer
+    int steps = 1000;  // Steps to run in headless mode
+    bool hasSeed = false;
+    Uint64 seed = 1;
+    int threads = 0;  // Growth worker threads, 0 picks one per hardware thread
+    int display = -1;  // Index into DISPLAY_PRESETS, -1 picks one from the desktop resolution
+    int mapWidth = 0;  // World size in cells, 0 fills one screen of the display
+    int mapHeight = 0;
+    std::string loadPath;  // Start from this save file instead of a new city
+    std::string savePath;  // Save here periodically, on the save key and on exit
+    int saveInterval = DEFAULT_SAVE_INTERVAL;  // Steps between saves, 0 only saves on request and exit
+    std::string tracePath;  // Write a Chrome trace of the scoped timers here on exit
+    std::string recordDir;  // Write numbered PNG frames into this directory
+    std::string recordPipe;  // Or pipe raw RGB24 frames into this encoder command
+    int recordEvery = 1;  // Simulation steps between recorded frames
+    bool showHud = false;  // Start with the perf HUD visible
+    CityParams params;  // Growth constants, changed with --param
+    int batchRuns = 0;  // Seeds simulated per parameter combination, 0 runs a single city
+    std::vector<ParamSweep> sweeps;  // Batches run every combination of these values
+};
+
+// Batched draw submission in world pixels. Fills, axis-aligned lines, points and texture
+// copies are mapped to the target by the current transform and queued in the runtime's
+// RtBatch, which sends them in as few driver calls as possible. Anything that changes
+// renderer state must flush() first.
+class RenderBatch {
+public:
+    RenderBatch() { std::memset(&batch, 0, sizeof(batch)); }
+    ~RenderBatch() { rt_batch_free(&batch); }
+    RenderBatch(const RenderBatch&) = delete;
+    RenderBatch& operator=(const RenderBatch&) = delete;
+    
+    void begin(SDL_Renderer* target) { rt_batch_begin(&batch, target); }
+    
+    void setColor(Uint8 r, Uint8 g, Uint8 b, Uint8 a) { color = {r, g, b, a}; }
+    
+    // Map world pixel (x, y) to ((x - originX) * zoom, (y - originY) * zoom) for subsequent draws
+    void setTransform(float originX, float originY, float zoom) {
+        offsetX = originX;
+        offsetY = originY;
+        scale = zoom;
+    }
+    
+    // Clip subsequent fills on the CPU, so changing it does not split the batch
+    void setClip(const SDL_Rect* rect) {
+        hasClip = rect != nullptr;
+        if (hasClip) clip = *rect;
+    }
+    
+    void fillRect(const SDL_Rect& rect) {
+        SDL_Rect r = rect;
+        if (hasClip && !SDL_IntersectRect(&rect, &clip, &r)) return;
+        if (r.w <= 0 || r.h <= 0) return;
+        rt_batch_fill(&batch, screenX(r.x), screenY(r.y), screenX(r.x + r.w), screenY(r.y + r.h), color);
+    }
+    
+    // Lines include both end points, like SDL_RenderDrawLine
+    void drawLine(int x1, int y1, int x2, int y2) {
+        if (x1 == x2 || y1 == y2) {
+            fillRect({std::min(x1, x2), std::min(y1, y2), std::abs(x2 - x1) + 1, std::abs(y2 - y1) + 1});
+            return;
+        }
+        rt_batch_line(&batch, static_cast<int>(std::lround(screenX(x1))), static_cast<int>(std::lround(screenY(y1))),
+                      static_cast<int>(std::lround(screenX(x2))), static_cast<int>(std::lround(screenY(y2))), color);
+    }
+    
+    void drawPoint(int x, int y) { fillRect({x, y, 1, 1}); }
+    
+    void copy(SDL_Texture* source, const SDL_Rect& src, const SDL_Rect& dst) {
+        rt_batch_copy(&batch, source, &src, screenX(dst.x), screenY(dst.y), screenX(dst.x + dst.w), screenY(dst.y + dst.h));
+    }
+    
+    void flush() { rt_batch_flush(&batch); }
+    
+    // Driver calls issued since the last reset, for the perf HUD
+    int drawCallCount() const { return batch.draw_calls; }
+    void resetDrawCallCount() { batch.draw_calls = 0; }
+    
+    // For runtime helpers that draw in target pixels, such as the HUD
+    RtBatch* raw() { return &batch; }
+    
+private:
+    float screenX(int x) const { return (x - offsetX) * scale; }
+    float screenY(int y) const { return (y - offsetY) * scale; }
+    
+    RtBatch batch;
+    SDL_Color color = {0, 0, 0, 255};
+    float offsetX = 0.0f;
+    float offsetY = 0.0f;
+    float scale = 1.0f;
+    bool hasClip = false;
+    SDL_Rect clip = {0, 0, 0, 0};
+};
+
+RenderBatch renderBatch;
+
+// Function prototypes
+void initializeGrid();
+void resetCityState();
+void simulationStep();
+void resetSnapshots();
+void publishSnapshot();
+bool acquireSnapshot();
+void runSimulationThread();
+void updateSaveImage();
+bool saveCity(const std::string& path);
+void checkAutoSave();
+bool restoreCity(const char* bytes, size_t size);
+bool loadCity(const std::string& path);
+void drawGrid(SDL_Renderer* renderer, const CitySnapshot& frame, float alpha);
+void generateInitialRoads();
+void generateTerrain();
+void generateTerrainTile(int tileIndex, Uint64 terrainSeed);
+int terrainScale();
+bool isValidCell(int x, int y);
+bool isCellType(int x, int y, CellType type);
+void setCellType(int x, int y, CellType type);
+void rebuildRoadMasks();
+void refreshBuildingSpot(int x, int y);
+void refreshRoadSpot(int x, int y);
+bool isStructureCell(int x, int y);
+bool isBuildingSpot(int x, int y);
+bool isRoadSpot(int x, int y);
+void markCellDirty(int x, int y);
+int countNeighborsOfType(int x, int y, CellType type);
+template <typename Shape>
+int countNeighborsOfTypeInRadius(Shape shape, int x, int y, CellType type, int radius);
+void growCity();
+void placeNewBuildings();
+void matureBuildings();
+int tileOf(int cell);
+template <typename Shape>
+void planBuildings(Shape shape, SimTile& tile);
+void commitBuilding(SimTile& tile, const PlannedBuilding& plan);
+void matureTile(SimTile& tile);
+void growRoads();
+void updateCars();
+bool isCarBlocked(int i);
+void addRoad(int x, int y);
+int regionOf(int cell);
+bool isTripEnd(CellType type, int purpose);
+bool isRouteTarget(int x, int y, int destination);
+void relaxFlowField(FlowField& field);
+void buildFlowField(FlowField& field, int destination);
+void updateFlowField(FlowField& field);
+FlowField& flowFieldFor(int destination);
+Uint16 routeDistance(const FlowField& field, int x, int y);
+int pickDestination(int purpose);
+int routeDirection(int i, int x, int y, int options);
+void drawCars(RenderBatch& batch, const CitySnapshot& frame, const CellRange& view, float alpha);
+void addRandomCar();
+SDL_Color getBuildingColor(const Building& building);
+void drawBuilding(RenderBatch& batch, int x, int y, const Building& building);
+void drawWater(RenderBatch& batch, int x, int y, int phase);
+void drawRoad(RenderBatch& batch, int x, int y, int mask);
+int roadMaskAt(const CitySnapshot& frame, int x, int y);
+void drawTree(RenderBatch& batch, int x, int y, int size);
+Building buildingVisualForm(const Building& building);
+int buildingVisualId(const Building& visual);
+void buildSpriteLayout();
+bool bakeSpriteAtlas(SDL_Renderer* renderer);
+int cellSprite(const CitySnapshot& frame, int x, int y);
+void drawStaticCell(RenderBatch& batch, const CitySnapshot& frame, int x, int y);
+void drawStaticCells(RenderBatch& batch, const CitySnapshot& frame, const CellRange& range);
+CellRange visibleCells();
+void clampCamera();
+void centerCamera();
+void zoomCamera(float factor, float screenX, float screenY);
+StaticChunk* chunkAt(int column, int row);
+CellRange chunkCells(int column, int row);
+bool ensureChunkTexture(SDL_Renderer* renderer, int column, int row);
+void redrawChunk(SDL_Renderer* renderer, const CitySnapshot& frame, int column, int row);
+Uint32 lodColor(const CitySnapshot& frame, int x, int y);
+bool updateLodLayer(SDL_Renderer* renderer);
+void updateStaticLayer(SDL_Renderer* renderer, const CitySnapshot& frame, const CellRange& view, bool lod);
+void invalidateStaticLayer();
+void destroyStaticLayer();
+void drawHud(SDL_Renderer* renderer, TTF_Font* font, const CitySnapshot& frame, const HudStats& stats);
+void initializeWaterAnimation();
+bool updateWaterAnimation();
+
+// Initialize water animation colors
+void initializeWaterAnimation() {
+    waterColors[0] = {20, 100, 200, 255};
+    waterColors[1] = {25, 110, 205, 255};
+    waterColors[2] = {30, 120, 210, 255};
+    waterColors[3] = {35, 130, 215, 255};
+    waterColors[4] = {40, 140, 220, 255};
+    waterColors[5] = {35, 130, 215, 255};
+    waterColors[6] = {30, 120, 210, 255};
+    waterColors[7] = {25, 110, 205, 255};
+}
+
+// Update water animation phase, returns true when the phase changed
+bool updateWaterAnimation() {
+    Uint32 currentTime = SDL_GetTicks();
+    if (currentTime - lastWaterAnimTime > WATER_ANIM_DELAY) {
+        waterAnimPhase = (waterAnimPhase + 1) % WATER_ANIM_PHASES;
+        lastWaterAnimTime = currentTime;
+        return true;
+    }
+    return false;
+}
+
+// Check if coordinates are within grid bounds
+bool isValidCell(int x, int y) {
+    return city->grid.inBounds(x, y);
+}
+
+// Check if a cell is inside the grid and holds the given type
+bool isCellType(int x, int y, CellType type) {
+    return city->grid.inBounds(x, y) && city->grid(x, y) == type;
+}
+
+// Count neighbors of a specific type (using 4 directions)
+int countNeighborsOfType(int x, int y, CellType type) {
+    int count = 0;
+    for (int i = 0; i < 4; i++) {
+        int nx = x + dx[i];
+        int ny = y + dy[i];
+        if (isCellType(nx, ny, type)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Count neighbors of a specific type within a radius, on a map of the given shape
+template <typename Shape>
+int countNeighborsOfTypeInRadius(Shape shape, int x, int y, CellType type, int radius) {
+    int count = city->cellBits.count(shape, type, x - radius, y - radius, x + radius, y + radius);
+    if (isCellType(x, y, type)) {
+        count--; // The center cell itself is not a neighbor
+    }
+    return count;
+}
+
+// Update the building-spot frontier membership of a single cell
+void refreshBuildingSpot(int x, int y) {
+    if (!isValidCell(x, y)) return;
+    
+    int cell = city->grid.index(x, y);
+    if (isBuildingSpot(x, y)) {
+        city->buildingSpots.insert(cell);
+    } else {
+        city->buildingSpots.erase(cell);
+    }
+}
+
+// Check if a cell holds a building or terrain feature that roads grow towards
+bool isStructureCell(int x, int y) {
+    if (!isValidCell(x, y)) return false;
+    CellType type = city->grid(x, y);
+    return type != EMPTY && type != ROAD && type != WATER;
+}
+
+// Building spots are EMPTY cells next to a road
+bool isBuildingSpot(int x, int y) {
+    return city->grid(x, y) == EMPTY && city->roadMasks(x, y) != 0;
+}
+
+// Road spots are building spots that also touch a structure
+bool isRoadSpot(int x, int y) {
+    if (!isBuildingSpot(x, y)) return false;
+    for (int d = 0; d < 4; d++) {
+        if (isStructureCell(x + dx[d], y + dy[d])) return true;
+    }
+    return false;
+}
+
+// Update the road-spot candidate membership of a single cell
+void refreshRoadSpot(int x, int y) {
+    if (!isValidCell(x, y)) return;
+    
+    int cell = city->grid.index(x, y);
+    if (isRoadSpot(x, y)) {
+        city->roadSpots.insert(cell);
+    } else {
+        city->roadSpots.erase(cell);
+    }
+}
+
+// Queue a cell to be redrawn in the cached static layer
+void markCellDirty(int x, int y) {
+    if (isValidCell(x, y)) {
+        city->dirtyCells.insert(city->grid.index(x, y));
+        city->unsavedCells.insert(city->grid.index(x, y));
+    }
+}
+
+// Recompute every cell's road connectivity mask from the grid
+void rebuildRoadMasks() {
+    for (int y = 0; y < city->gridHeight; y++) {
+        for (int x = 0; x < city->gridWidth; x++) {
+            Uint8 mask = 0;
+            for (int d = 0; d < 4; d++) {
+                if (isCellType(x + dx[d], y + dy[d], ROAD)) {
+                    mask |= static_cast<Uint8>(1 << d);
+                }
+            }
+            city->roadMasks(x, y) = mask;
+        }
+    }
+}
+
+// Change the type of a cell and keep the derived lookup structures in sync
+void setCellType(int x, int y, CellType type) {
+    CellType previous = city->grid(x, y);
+    city->grid(x, y) = type;
+    
+    // Cached flow fields fold in new roads and trip ends the next time they are used
+    if (city->newestFlowField >= 0 && previous != type &&
+        (type == ROAD || isTripEnd(type, TRIP_WORK) || isTripEnd(type, TRIP_HOME))) {
+        city->routeChanges.push_back(city->grid.index(x, y));
+    }
+    
+    if (previous != type) {
+        city->cellBits.set(x, y, previous, type);
+    }
+    
+    if ((type == ROAD) != (previous == ROAD)) {
+        // This cell lies in direction (d + 2) % 4 from its neighbor in direction d
+        for (int d = 0; d < 4; d++) {
+            int nx = x + dx[d];
+            int ny = y + dy[d];
+            if (isValidCell(nx, ny)) {
+                city->roadMasks(nx, ny) ^= static_cast<Uint8>(1 << ((d + 2) % 4));
+            }
+        }
+    }
+    
+    refreshBuildingSpot(x, y);
+    refreshRoadSpot(x, y);
+    markCellDirty(x, y);
+    if (previous != type) {
+        // Any change can add or remove a structure or road next to a road-spot candidate
+        for (int d = 0; d < 4; d++) {
+            refreshRoadSpot(x + dx[d], y + dy[d]);
+        }
+    }
+    if (type == ROAD || previous == ROAD) {
+        // Neighbors change frontier membership and road markings
+        for (int d = 0; d < 4; d++) {
+            refreshBuildingSpot(x + dx[d], y + dy[d]);
+            markCellDirty(x + dx[d], y + dy[d]);
+        }
+    }
+}
+
+// Initialize the grid with empty cells and generate a new city on it
+void initializeGrid() {
+    resetCityState();
+    
+    // Tile streams are derived from the growth stream, so they follow the run seed
+    Uint64 tileSeed = (static_cast<Uint64>(city->growthRng()) << 32) | city->growthRng();
+    for (size_t t = 0; t < city->simTiles.size(); t++) {
+        city->simTiles[t].rng.seed(splitMix64(tileSeed), 16 + t);
+    }
+    
+    // Generate terrain features first
+    generateTerrain();
+    
+    // Generate initial roads
+    generateInitialRoads();
+}
+
+// Size the city state for gridWidth x gridHeight and clear it, before generating or loading a city
+void resetCityState() {
+    // Initialize all cells and buildings to empty
+    city->grid.resize(city->gridWidth, city->gridHeight, EMPTY);
+    city->buildings.resize(city->gridWidth, city->gridHeight, {EMPTY, 0, BASIC, 0, false, false});
+    city->roadMasks.resize(city->gridWidth, city->gridHeight, 0);
+    city->buildingSpots.reset(city->gridWidth * city->gridHeight);
+    city->roadSpots.reset(city->gridWidth * city->gridHeight);
+    city->cellBits.reset(city->gridWidth, city->gridHeight);
+    city->dirtyCells.reset(city->gridWidth * city->gridHeight);
+    city->unsavedCells.reset(city->gridWidth * city->gridHeight);
+    city->roads.clear();
+    city->roadIds.resize(city->gridWidth, city->gridHeight, -1);
+    city->waterCells.clear();
+    city->cars = CarFleet();
+    city->homes.clear();
+    city->workplaces.clear();
+    city->flowFields.clear();
+    city->freeFlowFields.clear();
+    city->newestFlowField = -1;
+    city->oldestFlowField = -1;
+    city->flowFieldRoads = 0;
+    int regionCount = ((city->gridWidth + REGION_CELLS - 1) / REGION_CELLS) * ((city->gridHeight + REGION_CELLS - 1) / REGION_CELLS);
+    city->flowFieldSlots.assign(2 * regionCount, -1);
+    city->routeChanges.clear();
+    city->droppedRouteChanges = 0;
+    city->currentStep = 0;
+    city->growthTick = 0;
+    
+    city->tileColumns = (city->gridWidth + TILE_CELLS - 1) / TILE_CELLS;
+    city->tileRows = (city->gridHeight + TILE_CELLS - 1) / TILE_CELLS;
+    city->simTiles.clear();
+    city->simTiles.resize(city->tileColumns * city->tileRows);
+}
+
+// Initial road branches scale with the map area, relative to the default screen-sized map
+int terrainScale() {
+    return std::max(1, city->gridWidth * city->gridHeight / (DEFAULT_GRID_WIDTH * DEFAULT_GRID_HEIGHT));
+}
+
+// Cells of a tile plus the margin its terrain features may spill into
+struct TerrainRegion {
+    int x0, y0, x1, y1;  // Half-open
+    
+    bool contains(int x, int y) const {
+        return x >= x0 && x < x1 && y >= y0 && y < y1;
+    }
+};
+
+// Generate terrain features like water bodies, forests, etc. Every tile places its own
+// features from its own stream, in four passes by tile column and row parity. Features spill
+// at most TERRAIN_MARGIN cells out of their tile, so tiles of one pass never write the same
+// cells and the map only depends on the seed, not on the thread count.
+void generateTerrain() {
+    Uint64 terrainSeed = (static_cast<Uint64>(city->terrainRng()) << 32) | city->terrainRng();
+    std::vector<int> passTiles;
+    for (int pass = 0; pass < 4; pass++) {
+        passTiles.clear();
+        for (int ty = pass / 2; ty < city->tileRows; ty += 2) {
+            for (int tx = pass % 2; tx < city->tileColumns; tx += 2) {
+                passTiles.push_back(ty * city->tileColumns + tx);
+            }
+        }
+        runTiles(static_cast<int>(passTiles.size()), [&](int i) {
+            generateTerrainTile(passTiles[i], terrainSeed);
+        });
+    }
+    
+    // The tiles wrote grid and buildings directly, the structures setCellType keeps are
+    // filled in one pass. Terrain never touches roads, so the road derived sets stay empty.
+    city->cellBits.rebuild(city->grid);
+    city->waterCells.clear();
+    for (int y = 0; y < city->gridHeight; y++) {
+        for (int x = 0; x < city->gridWidth; x++) {
+            if (city->grid(x, y) == WATER) {
+                city->waterCells.push_back({x, y});
+            }
+        }
+    }
+}
+
+// Features of one kind for a tile: the count the reference map gets, scaled by the tile's
+// share of its area and rounded at random so small tiles still get some
+int terrainFeatureCount(Rng& rng, int lo, int hi, int tileArea) {
+    int scaled = rng.range(lo, hi) * tileArea;
+    int referenceArea = DEFAULT_GRID_WIDTH * DEFAULT_GRID_HEIGHT;
+    return scaled / referenceArea + (static_cast<int>(rng.below(referenceArea)) < scaled % referenceArea);
+}
+
+// Place one tile's rivers, lakes, forests and farms on empty cells of its region
+void generateTerrainTile(int tileIndex, Uint64 terrainSeed) {
+    SimTile& tile = city->simTiles[tileIndex];
+    Uint64 state = terrainSeed + static_cast<Uint64>(tileIndex) * 0x9E3779B97F4A7C15ULL;
+    Rng rng;
+    rng.seed(splitMix64(state), tileIndex);
+    
+    int tileX0 = (tileIndex % city->tileColumns) * TILE_CELLS;
+    int tileY0 = (tileIndex / city->tileColumns) * TILE_CELLS;
+    int tileX1 = std::min(city->gridWidth, tileX0 + TILE_CELLS);
+    int tileY1 = std::min(city->gridHeight, tileY0 + TILE_CELLS);
+    int tileArea = (tileX1 - tileX0) * (tileY1 - tileY0);
+    TerrainRegion region = {std::max(0, tileX0 - TERRAIN_MARGIN), std::max(0, tileY0 - TERRAIN_MARGIN),
+                            std::min(city->gridWidth, tileX1 + TERRAIN_MARGIN), std::min(city->gridHeight, tileY1 + TERRAIN_MARGIN)};
+    auto isFree = [&](int x, int y) {
+        return region.contains(x, y) && city->grid(x, y) == EMPTY;
+    };
+    
+    // Features start inside the tile and away from the map border
+    int startX0 = std::max(5, tileX0);
+    int startX1 = std::min(city->gridWidth - 5, tileX1 - 1);
+    int startY0 = std::max(5, tileY0);
+    int startY1 = std::min(city->gridHeight - 5, tileY1 - 1);
+    if (startX0 > startX1 || startY0 > startY1) return;
+    
+    // Generate water bodies (rivers and lakes)
+    int waterBodies = terrainFeatureCount(rng, 1, 3, tileArea);
+    
+    for (int i = 0; i < waterBodies; i++) {
+        int startX = rng.range(startX0, startX1);
+        int startY = rng.range(startY0, startY1);
+        
+        // Generate a river or lake
+        if (rng.range(0, 1) == 0) {
+            // River
+            int length = 15 + rng.below(20);
+            int dir = rng.below(4);
+            int curX = startX;
+            int curY = startY;
+            
+            for (int j = 0; j < length; j++) {
+                // Occasionally change direction slightly
+                if (rng.below(5) == 0) {
+                    dir = (dir + rng.range(-1, 1) + 4) % 4;
+                }
+                
+                // Create river segment and some surrounding water
+                for (int ox = -1; ox <= 1; ox++) {
+                    for (int oy = -1; oy <= 1; oy++) {
+                        if (isFree(curX + ox, curY + oy)) {
+                            city->grid(curX + ox, curY + oy) = WATER;
+                        }
+                    }
+                }
+                
+                // Move to next position
+                curX += dx[dir];
+                curY += dy[dir];
+                if (!region.contains(curX, curY)) break;
+            }
+        } else {
+            // Lake
+            tile.flood.clear();
+            tile.flood.push_back({startX, startY});
+            int size = rng.range(20, 40);
+            
+            for (size_t head = 0; head < tile.flood.size() && size > 0; head++) {
+                auto [x, y] = tile.flood[head];
+                
+                if (!isFree(x, y)) continue;
+                
+                city->grid(x, y) = WATER;
+                size--;
+                
+                for (int d = 0; d < 4; d++) {
+                    if (rng.range(0, 100) < 70) { // 70% chance to expand
+                        tile.flood.push_back({x + dx[d], y + dy[d]});
+                    }
+                }
+            }
+        }
+    }
+    
+    // Generate forests
+    int forestCount = terrainFeatureCount(rng, 2, 5, tileArea);
+    
+    for (int i = 0; i < forestCount; i++) {
+        int startX = rng.range(startX0, startX1);
+        int startY = rng.range(startY0, startY1);
+        
+        tile.flood.clear();
+        tile.flood.push_back({startX, startY});
+        int size = rng.range(10, 30);
+        
+        for (size_t head = 0; head < tile.flood.size() && size > 0; head++) {
+            auto [x, y] = tile.flood[head];
+            
+            if (!isFree(x, y)) continue;
+            
+            city->grid(x, y) = FOREST;
+            city->buildings(x, y).type = FOREST;
+            city->buildings(x, y).variant = rng.below(3); // Different tree types
+            size--;
+            
+            for (int d = 0; d < 4; d++) {
+                if (rng.range(0, 100) < 60) { // 60% chance to expand
+                    tile.flood.push_back({x + dx[d], y + dy[d]});
+                }
+            }
+        }
+    }
+    
+    // Generate farms in some areas
+    int farmCount = terrainFeatureCount(rng, 1, 3, tileArea);
+    
+    for (int i = 0; i < farmCount; i++) {
+        int startX = rng.range(startX0, startX1);
+        int startY = rng.range(startY0, startY1);
+        
+        int width = rng.range(5, 10);
+        int height = rng.range(5, 10);
+        
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int nx = startX + x;
+                int ny = startY + y;
+                if (isFree(nx, ny)) {
+                    city->grid(nx, ny) = FARM;
+                    city->buildings(nx, ny).type = FARM;
+                    city->buildings(nx, ny).variant = rng.below(3); // Different farm types
+                }
+            }
+        }
+    }
+}
+
+// Turn a cell into road and append it to the road list
+void addRoad(int x, int y) {
+    setCellType(x, y, ROAD);
+    city->roadIds(x, y) = static_cast<int>(city->roads.size());
+    city->roads.push_back({x, y});
+}
+
+// Generate initial road layout
+void generateInitialRoads() {
+    // Create a main horizontal road
+    int mainRoadY = city->gridHeight / 2;
+    for (int x = 0; x < city->gridWidth; x++) {
+        if (city->grid(x, mainRoadY) == EMPTY) {
+            addRoad(x, mainRoadY);
+        }
+    }
+    
+    // Create a main vertical road
+    int mainRoadX = city->gridWidth / 2;
+    for (int y = 0; y < city->gridHeight; y++) {
+        if (city->grid(mainRoadX, y) == EMPTY) {
+            addRoad(mainRoadX, y);
+        }
+    }
+    
+    // Add some random roads branching from main roads
+    int branchCount = city->params.initialRoads * terrainScale();
+    for (int i = 0; i < branchCount; i++) {
+        // Start from an existing road
+        int x, y;
+        if (i % 2 == 0) {
+            // Start from main horizontal road
+            x = city->roadRng.below(city->gridWidth);
+            y = mainRoadY;
+        } else {
+            // Start from main vertical road
+            x = mainRoadX;
+            y = city->roadRng.below(city->gridHeight);
+        }
+        
+        // Pick a direction (0: left, 1: down, 2: right, 3: up)
+        int direction = city->roadRng.range(0, 3);
+        int length = city->roadRng.range(5, 15);
+        
+        for (int j = 0; j < length; j++) {
+            x += dx[direction];
+            y += dy[direction];
+            
+            if (isCellType(x, y, EMPTY)) {
+                addRoad(x, y);
+            } else {
+                break;
+            }
+        }
+    }
+    
+    // Add some cars
+    for (int i = 0; i < 15; i++) {
+        addRandomCar();
+    }
+}
+
+// Add a new random car to the simulation
+void addRandomCar() {
+    if (city->roads.empty()) return;
+    
+    int roadIndex = city->carRng.below(city->roads.size());
+    int destination = -1;
+    
+    // Commuters start on the road outside a home and head for work, the rest wander
+    if (!city->homes.empty() && !city->workplaces.empty()) {
+        int home = city->homes[city->carRng.below(city->homes.size())];
+        for (int d = 0; d < 4; d++) {
+            int nx = home % city->gridWidth + dx[d];
+            int ny = home / city->gridWidth + dy[d];
+            if (isCellType(nx, ny, ROAD)) {
+                roadIndex = city->roadIds(nx, ny);
+                break;
+            }
+        }
+        destination = pickDestination(TRIP_WORK);
+    }
+    auto [x, y] = city->roads[roadIndex];
+    
+    float speed = city->carRng.uniform(0.05f, 0.2f);
+    int direction = city->carRng.range(0, 3);
+    SDL_Color color = {
+        static_cast<Uint8>(city->carRng.range(150, 250)), 
+        static_cast<Uint8>(city->carRng.range(150, 250)), 
+        static_cast<Uint8>(city->carRng.range(150, 250)), 
+        255
+    };
+    
+    city->cars.add(x, y, speed, direction, roadIndex, color, destination);
+}
+
+// Update car positions
+void updateCars() {
+    ScopedPhaseTimer timer("updateCars", &city->phaseTimings.cars);
+    if (city->roads.empty()) return;
+    
+    int count = city->cars.size();
+    city->cars.prevX = city->cars.x;
+    city->cars.prevY = city->cars.y;
+    city->cars.nextX.resize(count);
+    city->cars.nextY.resize(count);
+    city->cars.onRoad.resize(count);
+    city->cars.blocked.resize(count);
+    city->cars.turning.clear();
+    
+    // Queueing and yielding are decided from where every car was at the start of the step
+    city->carIndex.build(city->cars, city->gridWidth);
+    for (int i = 0; i < count; i++) {
+        city->cars.blocked[i] = isCarBlocked(i);
+    }
+    
+    // Fast path: move every car along its current direction
+    advancePositions(city->cars.x.data(), city->cars.velX.data(), city->cars.nextX.data(), count);
+    advancePositions(city->cars.y.data(), city->cars.velY.data(), city->cars.nextY.data(), count);
+    
+    for (int i = 0; i < count; i++) {
+        city->cars.onRoad[i] = isCellType(static_cast<int>(city->cars.nextX[i]), static_cast<int>(city->cars.nextY[i]), ROAD);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        bool moves = city->cars.onRoad[i] && !city->cars.blocked[i];
+        city->cars.x[i] = moves ? city->cars.nextX[i] : city->cars.x[i];
+        city->cars.y[i] = moves ? city->cars.nextY[i] : city->cars.y[i];
+    }
+    
+    // Routed cars decide where to go as they pass the center of each cell
+    for (int i = 0; i < count; i++) {
+        if (city->cars.destination[i] < 0 || !city->cars.onRoad[i] || city->cars.blocked[i]) continue;
+        
+        int direction = city->cars.direction[i];
+        bool horizontal = direction % 2 == 0;
+        float from = horizontal ? city->cars.prevX[i] : city->cars.prevY[i];
+        float to = horizontal ? city->cars.x[i] : city->cars.y[i];
+        if (static_cast<int>(from) == static_cast<int>(to)) continue;
+        
+        // The cell whose center was crossed, moving west or north that is the one being left
+        int center = (dx[direction] + dy[direction]) > 0 ? static_cast<int>(to) : static_cast<int>(from);
+        int lane = static_cast<int>(horizontal ? city->cars.y[i] : city->cars.x[i]);
+        int cx = horizontal ? center : lane;
+        int cy = horizontal ? lane : center;
+        int options = city->roadMasks.get(cx, cy, 0) & ~(1 << ((direction + 2) % 4));
+        int choice = routeDirection(i, cx, cy, options);
+        if (choice >= 0 && choice != direction) {
+            city->cars.x[i] = static_cast<float>(cx);
+            city->cars.y[i] = static_cast<float>(cy);
+            city->cars.setDirection(i, choice);
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (city->cars.blocked[i]) {
+            // Waiting cars only leave their queue if it never clears
+            if (++city->cars.wait[i] > MAX_CAR_WAIT) {
+                city->cars.turning.push_back(i);
+            }
+        } else {
+            city->cars.wait[i] = 0;
+            if (!city->cars.onRoad[i]) {
+                city->cars.turning.push_back(i);
+            }
+        }
+    }
+    
+    // Slow path: cars leaving the road need to change direction, and gridlocked cars a new road
+    for (int i : city->cars.turning) {
+        // Adjacent roads, excluding going backwards
+        int back = (city->cars.direction[i] + 2) % 4;
+        int mask = city->roadMasks.get(static_cast<int>(city->cars.x[i]), static_cast<int>(city->cars.y[i]), 0);
+        int forward = mask & ~(1 << back);
+        int choices = roadDirections.count[forward];
+        bool gridlocked = city->cars.wait[i] > MAX_CAR_WAIT;
+        
+        if (!gridlocked && choices > 0) {
+            // Follow the route if there is one, otherwise choose a random valid direction
+            int choice = routeDirection(i, static_cast<int>(city->cars.x[i]), static_cast<int>(city->cars.y[i]), forward);
+            city->cars.setDirection(i, choice >= 0 ? choice : roadDirections.nth[forward][city->carRng.below(choices)]);
+            city->cars.x[i] += city->cars.velX[i];
+            city->cars.y[i] += city->cars.velY[i];
+        } else if (!gridlocked && mask != 0) {
+            // Dead end, turn around
+            city->cars.setDirection(i, back);
+            city->cars.x[i] += city->cars.velX[i];
+            city->cars.y[i] += city->cars.velY[i];
+        } else {
+            // Stranded or stuck for too long, teleport to another road
+            city->cars.wait[i] = 0;
+            city->cars.roadIndex[i] = city->carRng.below(city->roads.size());
+            auto [newX, newY] = city->roads[city->cars.roadIndex[i]];
+            city->cars.x[i] = newX;
+            city->cars.y[i] = newY;
+            city->cars.prevX[i] = newX;  // Don't interpolate across the jump
+            city->cars.prevY[i] = newY;
+            
+            city->cars.setDirection(i, city->carRng.range(0, 3));
+        }
+    }
+    
+    // Occasionally add a new car
+    if (city->carRng.below(100) < static_cast<Uint32>(city->params.carSpawnChance) &&
+        static_cast<size_t>(city->cars.size()) < city->roads.size() / city->params.roadCellsPerCar) {
+        addRandomCar();
+    }
+}
+
+// A car stays put this step if moving would close in on a car ahead in its lane, or if it is
+// about to enter a junction that a crossing car occupies
+bool isCarBlocked(int i) {
+    int direction = city->cars.direction[i];
+    float reach = MIN_CAR_GAP + city->cars.speed[i];
+    int cell = static_cast<int>(city->cars.y[i]) * city->gridWidth + static_cast<int>(city->cars.x[i]);
+    int aheadX = static_cast<int>(city->cars.x[i] + dx[direction] * reach);
+    int aheadY = static_cast<int>(city->cars.y[i] + dy[direction] * reach);
+    int aheadCell = isValidCell(aheadX, aheadY) ? aheadY * city->gridWidth + aheadX : cell;
+    
+    bool blocked = false;
+    auto checkLeader = [&](int j) {
+        if (j == i || city->cars.direction[j] != direction) return;
+        // Distance ahead along the lane and offset across it
+        float along = (city->cars.x[j] - city->cars.x[i]) * dx[direction] + (city->cars.y[j] - city->cars.y[i]) * dy[direction];
+        float across = (city->cars.x[j] - city->cars.x[i]) * dy[direction] - (city->cars.y[j] - city->cars.y[i]) * dx[direction];
+        // Cars on the same spot queue by index so exactly one of them moves on
+        bool ahead = along > 0.0f || (along == 0.0f && j < i);
+        if (ahead && along < reach && std::fabs(across) < 0.5f) {
+            blocked = true;
+        }
+    };
+    city->carIndex.forEachInCell(cell, checkLeader);
+    if (aheadCell != cell) {
+        city->carIndex.forEachInCell(aheadCell, checkLeader);
+    }
+    if (blocked || aheadCell == cell) return blocked;
+    
+    // Yield to traffic crossing a junction, cars already inside always get to leave
+    if (roadDirections.count[city->roadMasks.get(aheadX, aheadY, 0)] >= 3) {
+        city->carIndex.forEachInCell(aheadCell, [&](int j) {
+            if ((city->cars.direction[j] ^ direction) & 1) {
+                blocked = true;
+            }
+        });
+    }
+    return blocked;
+}
+
+// Destination region containing a cell
+int regionOf(int cell) {
+    int regionColumns = (city->gridWidth + REGION_CELLS - 1) / REGION_CELLS;
+    return (cell / city->gridWidth / REGION_CELLS) * regionColumns + (cell % city->gridWidth) / REGION_CELLS;
+}
+
+bool isTripEnd(CellType type, int purpose) {
+    if (purpose == TRIP_HOME) return type == RESIDENTIAL;
+    return type == COMMERCIAL || type == INDUSTRIAL;
+}
+
+// A road cell is a target if it touches a trip end of the destination's purpose inside its region
+bool isRouteTarget(int x, int y, int destination) {
+    for (int d = 0; d < 4; d++) {
+        int nx = x + dx[d];
+        int ny = y + dy[d];
+        if (isValidCell(nx, ny) && isTripEnd(city->grid(nx, ny), destination % 2) &&
+            regionOf(city->grid.index(nx, ny)) == destination / 2) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Breadth-first relaxation from the road cells queued in flowFrontier. Distances only ever
+// shrink as roads and trip ends are added, so updates start from the changed cells alone.
+void relaxFlowField(FlowField& field) {
+    for (size_t head = 0; head < city->flowFrontier.size(); head++) {
+        int x = city->flowFrontier[head] % city->gridWidth;
+        int y = city->flowFrontier[head] / city->gridWidth;
+        int next = field.distance[city->roadIds(x, y)] + 1;
+        if (next >= UNREACHABLE) continue;
+        
+        int mask = city->roadMasks(x, y);
+        for (int d = 0; d < 4; d++) {
+            if ((mask & (1 << d)) == 0) continue;
+            int id = city->roadIds(x + dx[d], y + dy[d]);
+            if (next < field.distance[id]) {
+                field.distance[id] = static_cast<Uint16>(next);
+                city->flowFrontier.push_back(city->grid.index(x + dx[d], y + dy[d]));
+            }
+        }
+    }
+    city->flowFrontier.clear();
+}
+
+// Compute a field from scratch, seeded from the roads around the destination's trip ends
+void buildFlowField(FlowField& field, int destination) {
+    field.destination = destination;
+    field.distance.assign(city->roads.size(), UNREACHABLE);
+    field.appliedChanges = city->droppedRouteChanges + city->routeChanges.size();
+    
+    int regionColumns = (city->gridWidth + REGION_CELLS - 1) / REGION_CELLS;
+    int x0 = (destination / 2 % regionColumns) * REGION_CELLS;
+    int y0 = (destination / 2 / regionColumns) * REGION_CELLS;
+    city->flowFrontier.clear();
+    for (int y = y0; y < std::min(city->gridHeight, y0 + REGION_CELLS); y++) {
+        for (int x = x0; x < std::min(city->gridWidth, x0 + REGION_CELLS); x++) {
+            if (!isTripEnd(city->grid(x, y), destination % 2)) continue;
+            for (int d = 0; d < 4; d++) {
+                int nx = x + dx[d];
+                int ny = y + dy[d];
+                if (isCellType(nx, ny, ROAD) && field.distance[city->roadIds(nx, ny)] != 0) {
+                    field.distance[city->roadIds(nx, ny)] = 0;
+                    city->flowFrontier.push_back(city->grid.index(nx, ny));
+                }
+            }
+        }
+    }
+    relaxFlowField(field);
+}
+
+// Fold the roads and trip ends logged since the field was last used into it
+void updateFlowField(FlowField& field) {
+    size_t logged = city->droppedRouteChanges + city->routeChanges.size();
+    if (field.appliedChanges == logged) return;
+    
+    if (field.distance.capacity() < city->roads.size()) {
+        field.distance.reserve(city->roads.size() + city->roads.size() / FLOW_FIELD_HEADROOM);
+    }
+    field.distance.resize(city->roads.size(), UNREACHABLE);
+    city->flowFrontier.clear();
+    for (size_t k = field.appliedChanges - city->droppedRouteChanges; k < city->routeChanges.size(); k++) {
+        int cell = city->routeChanges[k];
+        int x = cell % city->gridWidth;
+        int y = cell / city->gridWidth;
+        
+        if (city->grid(x, y) == ROAD) {
+            // A new road starts out one step further than its best neighbor
+            int best = isRouteTarget(x, y, field.destination) ? 0 : UNREACHABLE;
+            int mask = city->roadMasks(x, y);
+            for (int d = 0; d < 4; d++) {
+                if (mask & (1 << d)) {
+                    best = std::min(best, field.distance[city->roadIds(x + dx[d], y + dy[d])] + 1);
+                }
+            }
+            if (best < field.distance[city->roadIds(x, y)]) {
+                field.distance[city->roadIds(x, y)] = static_cast<Uint16>(best);
+                city->flowFrontier.push_back(cell);
+            }
+        } else if (isTripEnd(city->grid(x, y), field.destination % 2) && regionOf(cell) == field.destination / 2) {
+            // A new trip end makes the roads around it targets
+            for (int d = 0; d < 4; d++) {
+                int nx = x + dx[d];
+                int ny = y + dy[d];
+                if (isCellType(nx, ny, ROAD) && field.distance[city->roadIds(nx, ny)] != 0) {
+                    field.distance[city->roadIds(nx, ny)] = 0;
+                    city->flowFrontier.push_back(city->grid.index(nx, ny));
+                }
+            }
+        }
+    }
+    relaxFlowField(field);
+    field.appliedChanges = logged;
+}
+
+// Take a cached field out of the recency list
+void unlinkFlowField(int slot) {
+    FlowField& field = city->flowFields[slot];
+    (field.newer >= 0 ? city->flowFields[field.newer].older : city->newestFlowField) = field.older;
+    (field.older >= 0 ? city->flowFields[field.older].newer : city->oldestFlowField) = field.newer;
+    field.newer = -1;
+    field.older = -1;
+}
+
+// Put a field at the most recently used end of the recency list
+void linkNewestFlowField(int slot) {
+    FlowField& field = city->flowFields[slot];
+    field.newer = -1;
+    field.older = city->newestFlowField;
+    (city->newestFlowField >= 0 ? city->flowFields[city->newestFlowField].newer : city->oldestFlowField) = slot;
+    city->newestFlowField = slot;
+}
+
+// Fields grow with the road network, so the cache holds fewer of them on bigger cities
+size_t flowFieldCapacity() {
+    size_t roadCount = std::max<size_t>(1, city->roads.size());
+    size_t fieldBytes = (roadCount + roadCount / FLOW_FIELD_HEADROOM) * sizeof(Uint16);
+    return std::max<size_t>(MIN_FLOW_FIELDS, FLOW_FIELD_BUDGET / fieldBytes);
+}
+
+// Evict least recently used fields, freeing their memory, until the cache fits the budget at
+// the current road count. Cached fields grow to the road count as they are used.
+void fitFlowFieldsToBudget() {
+    if (city->flowFieldRoads == city->roads.size()) return;
+    city->flowFieldRoads = city->roads.size();
+    size_t capacity = flowFieldCapacity();
+    while (city->flowFields.size() - city->freeFlowFields.size() > capacity) {
+        int slot = city->oldestFlowField;
+        unlinkFlowField(slot);
+        FlowField& field = city->flowFields[slot];
+        city->flowFieldSlots[field.destination] = -1;
+        field.destination = -1;
+        std::vector<Uint16>().swap(field.distance);
+        city->freeFlowFields.push_back(slot);
+    }
+}
+
+// Cached flow field for a destination, brought up to date. The least recently used field is
+// replaced when the cache is full. The reference stays valid until the next call.
+FlowField& flowFieldFor(int destination) {
+    fitFlowFieldsToBudget();
+    int slot = city->flowFieldSlots[destination];
+    if (slot >= 0) {
+        updateFlowField(city->flowFields[slot]);
+        if (slot != city->newestFlowField) {
+            unlinkFlowField(slot);
+            linkNewestFlowField(slot);
+        }
+    } else {
+        if (city->flowFields.size() - city->freeFlowFields.size() >= flowFieldCapacity()) {
+            // Rebuild the least recently used field in place, reusing its buffer
+            slot = city->oldestFlowField;
+            unlinkFlowField(slot);
+            city->flowFieldSlots[city->flowFields[slot].destination] = -1;
+        } else if (!city->freeFlowFields.empty()) {
+            slot = city->freeFlowFields.back();
+            city->freeFlowFields.pop_back();
+        } else {
+            slot = static_cast<int>(city->flowFields.size());
+            city->flowFields.emplace_back();
+        }
+        buildFlowField(city->flowFields[slot], destination);
+        city->flowFieldSlots[destination] = slot;
+        linkNewestFlowField(slot);
+    }
+    
+    // Drop the part of the change log every cached field has already applied. Each use brings a
+    // field up to the end of the log, so the least recently used field is the stalest.
+    size_t applied = city->flowFields[city->oldestFlowField].appliedChanges - city->droppedRouteChanges;
+    if (applied > city->routeChanges.size() / 2) {
+        city->routeChanges.erase(city->routeChanges.begin(), city->routeChanges.begin() + applied);
+        city->droppedRouteChanges += applied;
+    }
+    return city->flowFields[slot];
+}
+
+// Road steps from a cell to the field's destination, UNREACHABLE off the road network
+Uint16 routeDistance(const FlowField& field, int x, int y) {
+    if (!isCellType(x, y, ROAD)) return UNREACHABLE;
+    int id = city->roadIds(x, y);
+    return static_cast<size_t>(id) < field.distance.size() ? field.distance[id] : UNREACHABLE;
+}
+
+// Destination of a random trip end of the given purpose, -1 if there is none yet
+int pickDestination(int purpose) {
+    const std::vector<int>& ends = purpose == TRIP_HOME ? city->homes : city->workplaces;
+    if (ends.empty()) return -1;
+    return regionOf(ends[city->carRng.below(ends.size())]) * 2 + purpose;
+}
+
+// Direction among the options (a road mask) that brings car i closest to its destination, or -1
+// to choose at random. A car that has arrived turns around for the return trip.
+int routeDirection(int i, int x, int y, int options) {
+    if (city->cars.destination[i] < 0 || options == 0) return -1;
+    
+    const FlowField* field = &flowFieldFor(city->cars.destination[i]);
+    if (routeDistance(*field, x, y) == 0) {
+        int purpose = city->cars.destination[i] % 2 == TRIP_WORK ? TRIP_HOME : TRIP_WORK;
+        city->cars.destination[i] = pickDestination(purpose);
+        if (city->cars.destination[i] < 0) return -1;
+        field = &flowFieldFor(city->cars.destination[i]);
+    }
+    
+    // Equally good directions are picked between at random
+    int choice = -1;
+    int ties = 0;
+    Uint16 best = UNREACHABLE;
+    for (int d = 0; d < 4; d++) {
+        if ((options & (1 << d)) == 0) continue;
+        Uint16 distance = routeDistance(*field, x + dx[d], y + dy[d]);
+        if (distance == UNREACHABLE) continue;
+        if (distance < best) {
+            best = distance;
+            choice = d;
+            ties = 1;
+        } else if (distance == best && city->carRng.below(++ties) == 0) {
+            choice = d;
+        }
+    }
+    return choice;
+}
+
+// Draw cars
+// alpha is the fraction of the current step that has elapsed, positions are blended from the previous step
+void drawCars(RenderBatch& batch, const CitySnapshot& frame, const CellRange& view, float alpha) {
+    for (size_t i = 0; i < frame.carX.size(); i++) {
+        float carX = frame.carPrevX[i] + (frame.carX[i] - frame.carPrevX[i]) * alpha;
+        float carY = frame.carPrevY[i] + (frame.carY[i] - frame.carPrevY[i]) * alpha;
+        if (carX < view.x0 - 1 || carX >= view.x1 || carY < view.y0 - 1 || carY >= view.y1) continue;
+        
+        SDL_Color color = frame.carColors[i];
+        batch.setColor(color.r, color.g, color.b, color.a);
+        
+        SDL_Rect carRect;
+        carRect.x = static_cast<int>(carX * CELL_SIZE) + CELL_SIZE / 3;
+        carRect.y = static_cast<int>(carY * CELL_SIZE) + CELL_SIZE / 3;
+        carRect.w = CELL_SIZE / 3;
+        carRect.h = CELL_SIZE / 3;
+        
+        batch.fillRect(carRect);
+    }
+}
+
+// Grow the city by adding new buildings
+void growCity() {
+    ScopedPhaseTimer timer("growCity");
+    placeNewBuildings();
+    matureBuildings();
+    
+    // Add new roads as the city grows
+    if (city->currentStep % 10 == 0) {
+        growRoads();
+    }
+}
+
+// Place new buildings on spots picked from the frontier
+void placeNewBuildings() {
+    ScopedPhaseTimer timer("placeNewBuildings", &city->phaseTimings.buildingSpots);
+    
+    // Randomly select some spots from the frontier of empty cells next to roads
+    int maxBuildingsPerStep = 1 + city->currentStep / city->params.buildingRampSteps; // Gradually increase building rate
+    int newBuildings = city->buildingSpots.sampleFront(maxBuildingsPerStep, city->growthRng);
+    
+    // Hand the picks to their tiles, building on a spot removes it from the frontier
+    city->activeTiles.clear();
+    for (int i = 0; i < newBuildings; i++) {
+        int cell = city->buildingSpots[i];
+        int tile = tileOf(cell);
+        if (city->simTiles[tile].picks.empty()) {
+            city->activeTiles.push_back(tile);
+        }
+        city->simTiles[tile].picks.push_back(cell);
+    }
+    std::sort(city->activeTiles.begin(), city->activeTiles.end());
+    
+    // Plan phase only reads the grid and its bit planes. The map shape is picked once per
+    // step, so built-in sizes plan with constant strides.
+    visitGridShape(city->gridWidth, city->gridHeight, [](auto shape) {
+        runTiles(static_cast<int>(city->activeTiles.size()), [shape](int i) {
+            planBuildings(shape, city->simTiles[city->activeTiles[i]]);
+        });
+    });
+    
+    // Commit phase in tile order
+    for (int tileIndex : city->activeTiles) {
+        SimTile& tile = city->simTiles[tileIndex];
+        for (const PlannedBuilding& plan : tile.plans) {
+            commitBuilding(tile, plan);
+        }
+        tile.picks.clear();
+        tile.plans.clear();
+    }
+}
+
+// Tile of a cell index
+int tileOf(int cell) {
+    int x = cell % city->gridWidth;
+    int y = cell / city->gridWidth;
+    return (y / TILE_CELLS) * city->tileColumns + x / TILE_CELLS;
+}
+
+// Decide what to build on each of a tile's picks, reading the grid as it was at the start of the step
+template <typename Shape>
+void planBuildings(Shape shape, SimTile& tile) {
+    for (int cell : tile.picks) {
+        int x = cell % shape.width();
+        int y = cell / shape.width();
+        
+        CellType type;
+        int randType = tile.rng.range(0, 100);
+        
+        // Determine building type based on surroundings and random chance
+        const CityParams& params = city->params;
+        if (randType < params.residentialBelow) {
+            type = RESIDENTIAL;
+        } else if (randType < params.commercialBelow) {
+            type = COMMERCIAL;
+        } else {
+            type = INDUSTRIAL;
+        }
+        
+        // Check for water nearby to prefer residential
+        if (countNeighborsOfTypeInRadius(shape, x, y, WATER, 3) > 0 && randType < params.waterResidentialBelow) {
+            type = RESIDENTIAL;
+        }
+        
+        // Check for parks or forests nearby to prefer residential
+        if ((countNeighborsOfTypeInRadius(shape, x, y, PARK, 3) > 0 || 
+             countNeighborsOfTypeInRadius(shape, x, y, FOREST, 3) > 0) && randType < params.greenResidentialBelow) {
+            type = RESIDENTIAL;
+        }
+        
+        // Occasionally create a park instead
+        if (randType > params.parkAbove && city->currentStep > 50) {
+            type = PARK;
+        }
+        
+        PlannedBuilding plan;
+        plan.cell = cell;
+        plan.type = type;
+        plan.style = static_cast<BuildingStyle>(tile.rng.range(0, 3));
+        plan.variant = tile.rng.range(0, 4);
+        
+        // Sometimes add a tree to residential or commercial buildings
+        plan.hasTree = (type == RESIDENTIAL || type == COMMERCIAL) && tile.rng.range(0, 100) < 40;
+        tile.plans.push_back(plan);
+    }
+}
+
+// Apply a planned building to the grid and schedule its first maturation rolls
+void commitBuilding(SimTile& tile, const PlannedBuilding& plan) {
+    int x = plan.cell % city->gridWidth;
+    int y = plan.cell / city->gridWidth;
+    
+    // Update grid and building info
+    setCellType(x, y, plan.type);
+    Building& building = city->buildings(x, y);
+    building.type = plan.type;
+    building.density = 1;
+    building.style = plan.style;
+    building.variant = plan.variant;
+    building.hasTree = plan.hasTree;
+    
+    if (isTripEnd(plan.type, TRIP_HOME)) {
+        city->homes.push_back(plan.cell);
+    } else if (isTripEnd(plan.type, TRIP_WORK)) {
+        city->workplaces.push_back(plan.cell);
+    }
+    
+    if (plan.type == RESIDENTIAL || plan.type == COMMERCIAL || plan.type == INDUSTRIAL) {
+        tile.wheel.schedule(city->growthTick + DENSITY_GROWTH_INTERVAL, plan.cell * 2 + MATURE_DENSITY);
+    }
+    if (plan.type == RESIDENTIAL && !plan.hasTree) {
+        tile.wheel.schedule(city->growthTick + TREE_GROWTH_INTERVAL, plan.cell * 2 + MATURE_TREE);
+    }
+}
+
+// Age existing buildings: run the density and tree rolls that are due on this growth tick
+void matureBuildings() {
+    ScopedPhaseTimer timer("matureBuildings", &city->phaseTimings.maturation);
+    
+    city->growthTick++;
+    runTiles(static_cast<int>(city->simTiles.size()), [](int t) {
+        matureTile(city->simTiles[t]);
+    });
+    
+    for (SimTile& tile : city->simTiles) {
+        for (int cell : tile.changed) {
+            markCellDirty(cell % city->gridWidth, cell / city->gridWidth);
+        }
+        tile.changed.clear();
+    }
+}
+
+// Run one tile's due maturation rolls. Each roll only touches its own building.
+void matureTile(SimTile& tile) {
+    tile.wheel.takeDue(city->growthTick, tile.due);
+    
+    for (int event : tile.due) {
+        int cell = event / 2;
+        Building& building = city->buildings(cell % city->gridWidth, cell / city->gridWidth);
+        
+        if (event % 2 == MATURE_DENSITY) {
+            // Increase density for some buildings as they age
+            if (tile.rng.below(5) < 3) { // 60% chance to increase density
+                building.density++;
+                tile.changed.push_back(cell);
+            }
+            if (building.density < MAX_DENSITY) {
+                tile.wheel.schedule(city->growthTick + DENSITY_GROWTH_INTERVAL, event);
+            }
+        } else {
+            // Add a tree to some residential buildings over time
+            if (tile.rng.below(10) < 4) { // 40% chance to add a tree
+                building.hasTree = true;
+                tile.changed.push_back(cell);
+            } else {
+                tile.wheel.schedule(city->growthTick + TREE_GROWTH_INTERVAL, event);
+            }
+        }
+    }
+}
+
+// Extend the road network next to existing buildings
+void growRoads() {
+    ScopedPhaseTimer timer("growRoads", &city->phaseTimings.roadGrowth);
+    
+    // Randomly select some of the maintained candidates next to both a road and a building
+    int maxRoadsPerStep = 1 + city->currentStep / city->params.roadRampSteps; // Gradually increase road building rate
+    int newRoads = city->roadSpots.sampleFront(maxRoadsPerStep, city->roadRng);
+    
+    // Copy the picks out first, a new road changes the candidates around it
+    city->roadPicks.clear();
+    for (int i = 0; i < newRoads; i++) {
+        city->roadPicks.push_back(city->roadSpots[i]);
+    }
+    
+    for (int cell : city->roadPicks) {
+        int x = cell % city->gridWidth;
+        int y = cell / city->gridWidth;
+        
+        addRoad(x, y);
+    }
+}
+
+// Get building color based on type, density, and style
+SDL_Color getBuildingColor(const Building& building) {
+    SDL_Color color;
+    
+    switch (building.type) {
+        case RESIDENTIAL:
+            color = COLOR_RESIDENTIAL_BASE;
+            // Adjust color based on style and variant
+            switch (building.style) {
+                case BASIC:
+                    // No change for basic
+                    break;
+                case MODERN:
+                    color.r = 200 + building.variant * 10;
+                    color.g = 200 + building.variant * 10;
+                    color.b = 220 + building.variant * 5;
+                    break;
+                case HISTORIC:
+                    color.r = 190 + building.variant * 10;
+                    color.g = 150 + building.variant * 8;
+                    color.b = 130 + building.variant * 5;
+                    break;
+                case FANCY:
+                    color.r = 240 - building.variant * 5;
+                    color.g = 180 + building.variant * 10;
+                    color.b = 180 + building.variant * 10;
+                    break;
+            }
+            break;
+        
+        case COMMERCIAL:
+            color = COLOR_COMMERCIAL_BASE;
+            // Adjust color based on style and variant
+            switch (building.style) {
+                case BASIC:
+                    // No change for basic
+                    break;
+                case MODERN:
+                    color.r = 100 + building.variant * 5;
+                    color.g = 180 + building.variant * 10;
+                    color.b = 230 + building.variant * 5;
+                    break;
+                case HISTORIC:
+                    color.r = 150 + building.variant * 8;
+                    color.g = 160 + building.variant * 5;
+                    color.b = 180 + building.variant * 10;
+                    break;
+                case FANCY:
+                    color.r = 130 + building.variant * 10;
+                    color.g = 200 + building.variant * 5;
+                    color.b = 230 + building.variant * 5;
+                    break;
+            }
+            break;
+        
+        case INDUSTRIAL:
+            color = COLOR_INDUSTRIAL_BASE;
+            // Adjust color based on variant
+            color.r = color.r - building.variant * 10;
+            color.g = color.g - building.variant * 5;
+            break;
+        
+        case PARK:
+            color = COLOR_PARK;
+            // Slightly vary park colors
+            color.g = 160 + building.variant * 10;
+            break;
+        
+        case GOVERNMENT:
+            color = COLOR_GOVERNMENT;
+            break;
+        
+        case POWER_PLANT:
+            color = COLOR_POWER_PLANT;
+            break;
+        
+        case FOREST:
+            color = COLOR_FOREST;
+            // Vary forest colors
+            color.g = 120 + building.variant * 10;
+            break;
+        
+        case FARM:
+            color = COLOR_FARM;
+            // Vary farm colors
+            color.g = 190 + building.variant * 10;
+            color.r = 170 + building.variant * 8;
+            break;
+        
+        default:
+            color = {150, 150, 150, 255};
+    }
+    
+    // Adjust for building density
+    if (building.type == RESIDENTIAL || building.type == COMMERCIAL || building.type == INDUSTRIAL) {
+        int densityFactor = building.density - 1;
+        // Darken colors for higher density
+        color.r = std::max(50, color.r - densityFactor * 20);
+        color.g = std::max(50, color.g - densityFactor * 15);
+        color.b = std::max(50, color.b - densityFactor * 15);
+    }
+    
+    return color;
+}
+
+// Draw a building
+void drawBuilding(RenderBatch& batch, int x, int y, const Building& building) {
+    SDL_Rect buildingRect;
+    buildingRect.x = x * CELL_SIZE;
+    buildingRect.y = y * CELL_SIZE;
+    buildingRect.w = CELL_SIZE;
+    buildingRect.h = CELL_SIZE;
+    
+    SDL_Color color = getBuildingColor(building);
+    batch.setColor(color.r, color.g, color.b, 255);
+    batch.fillRect(buildingRect);
+    
+    // Draw building details based on type
+    switch (building.type) {
+        case RESIDENTIAL: {
+            // Draw house details based on density and style
+            if (building.density == 1) {
+                // Small house
+                SDL_Rect roofRect;
+                roofRect.x = x * CELL_SIZE + 1;
+                roofRect.y = y * CELL_SIZE + 1;
+                roofRect.w = CELL_SIZE - 2;
+                roofRect.h = CELL_SIZE / 3;
+                
+                // Roof color
+                batch.setColor(180, 100, 80, 255);
+                batch.fillRect(roofRect);
+                
                 // Window
                 SDL_Rect windowRect;
                 windowRect.x = x * CELL_SIZE + CELL_SIZE / 3;
@@ -793,475 +3075,1925 @@ void drawBuilding(SDL_Renderer* renderer, int x, int y, const Building& building
                 windowRect.w = CELL_SIZE / 3;
                 windowRect.h = CELL_SIZE / 4;
                 
-                SDL_SetRenderDrawColor(renderer, 220, 230, 250, 255);
-                SDL_RenderFillRect(renderer, &windowRect);
+                batch.setColor(220, 230, 250, 255);
+                batch.fillRect(windowRect);
             } else if (building.density == 2) {
                 // Medium house/apartment
                 // Windows
                 for (int i = 0; i < 2; i++) {
-                    for (int j = 0; j < 2; j++) {
-                        SDL_Rect windowRect;
-                        windowRect.x = x * CELL_SIZE + 2 + i * (CELL_SIZE / 2 - 2);
-                        windowRect.y = y * CELL_SIZE + 2 + j * (CELL_SIZE / 2 - 2);
-                        windowRect.w = CELL_SIZE / 3;
-                        windowRect.h = CELL_SIZE / 4;
+                    for (int j = 0; j < 2; j++) {
+                        SDL_Rect windowRect;
+                        windowRect.x = x * CELL_SIZE + 2 + i * (CELL_SIZE / 2 - 2);
+                        windowRect.y = y * CELL_SIZE + 2 + j * (CELL_SIZE / 2 - 2);
+                        windowRect.w = CELL_SIZE / 3;
+                        windowRect.h = CELL_SIZE / 4;
+                        
+                        batch.setColor(220, 230, 250, 255);
+                        batch.fillRect(windowRect);
+                    }
+                }
+            } else {
+                // Tall apartment building
+                for (int i = 0; i < 3; i++) {
+                    SDL_Rect windowRowRect;
+                    windowRowRect.x = x * CELL_SIZE + 2;
+                    windowRowRect.y = y * CELL_SIZE + 2 + i * (CELL_SIZE / 3);
+                    windowRowRect.w = CELL_SIZE - 4;
+                    windowRowRect.h = 2;
+                    
+                    batch.setColor(50, 50, 50, 255);
+                    batch.fillRect(windowRowRect);
+                }
+            }
+            
+            // Draw tree if present
+            if (building.hasTree) {
+                drawTree(batch, x, y, 1);
+            }
+            break;
+        }
+        
+        case COMMERCIAL: {
+            // Commercial building details
+            if (building.density == 1) {
+                // Small shop
+                SDL_Rect signRect;
+                signRect.x = x * CELL_SIZE + 2;
+                signRect.y = y * CELL_SIZE + 2;
+                signRect.w = CELL_SIZE - 4;
+                signRect.h = 4;
+                
+                batch.setColor(220, 220, 100, 255);
+                batch.fillRect(signRect);
+                
+                // Window/door
+                SDL_Rect windowRect;
+                windowRect.x = x * CELL_SIZE + CELL_SIZE / 4;
+                windowRect.y = y * CELL_SIZE + CELL_SIZE / 2;
+                windowRect.w = CELL_SIZE / 2;
+                windowRect.h = CELL_SIZE / 3;
+                
+                batch.setColor(200, 220, 240, 255);
+                batch.fillRect(windowRect);
+            } else if (building.density == 2) {
+                // Medium commercial building
+                // Windows grid
+                for (int i = 0; i < 2; i++) {
+                    for (int j = 0; j < 3; j++) {
+                        SDL_Rect windowRect;
+                        windowRect.x = x * CELL_SIZE + 2 + i * (CELL_SIZE / 2 - 2);
+                        windowRect.y = y * CELL_SIZE + 2 + j * (CELL_SIZE / 3 - 1);
+                        windowRect.w = CELL_SIZE / 3;
+                        windowRect.h = CELL_SIZE / 6;
+                        
+                        batch.setColor(180, 210, 240, 255);
+                        batch.fillRect(windowRect);
+                    }
+                }
+            } else {
+                // Office building
+                for (int i = 0; i < 4; i++) {
+                    SDL_Rect windowRowRect;
+                    windowRowRect.x = x * CELL_SIZE + 2;
+                    windowRowRect.y = y * CELL_SIZE + 2 + i * (CELL_SIZE / 4);
+                    windowRowRect.w = CELL_SIZE - 4;
+                    windowRowRect.h = CELL_SIZE / 8;
+                    
+                    batch.setColor(150, 200, 240, 255);
+                    batch.fillRect(windowRowRect);
+                }
+            }
+            
+            // Draw tree if present
+            if (building.hasTree) {
+                drawTree(batch, x, y, 1);
+            }
+            break;
+        }
+        
+        case INDUSTRIAL: {
+            // Industrial building details
+            if (building.density == 1) {
+                // Small warehouse
+                SDL_Rect doorRect;
+                doorRect.x = x * CELL_SIZE + CELL_SIZE / 3;
+                doorRect.y = y * CELL_SIZE + CELL_SIZE / 2;
+                doorRect.w = CELL_SIZE / 3;
+                doorRect.h = CELL_SIZE / 2;
+                
+                batch.setColor(100, 100, 100, 255);
+                batch.fillRect(doorRect);
+            } else if (building.density == 2) {
+                // Factory with smokestack
+                SDL_Rect stackRect;
+                stackRect.x = x * CELL_SIZE + CELL_SIZE / 4;
+                stackRect.y = y * CELL_SIZE;
+                stackRect.w = CELL_SIZE / 6;
+                stackRect.h = CELL_SIZE / 2;
+                
+                batch.setColor(80, 80, 80, 255);
+                batch.fillRect(stackRect);
+                
+                // Factory windows
+                SDL_Rect windowRect;
+                windowRect.x = x * CELL_SIZE + CELL_SIZE / 2;
+                windowRect.y = y * CELL_SIZE + CELL_SIZE / 3;
+                windowRect.w = CELL_SIZE / 3;
+                windowRect.h = CELL_SIZE / 6;
+                
+                batch.setColor(150, 150, 120, 255);
+                batch.fillRect(windowRect);
+            } else {
+                // Heavy industry
+                // Multiple stacks
+                for (int i = 0; i < 2; i++) {
+                    SDL_Rect stackRect;
+                    stackRect.x = x * CELL_SIZE + 2 + i * (CELL_SIZE / 2);
+                    stackRect.y = y * CELL_SIZE;
+                    stackRect.w = CELL_SIZE / 6;
+                    stackRect.h = CELL_SIZE / 2;
+                    
+                    batch.setColor(70, 70, 70, 255);
+                    batch.fillRect(stackRect);
+                }
+                
+                // Structure
+                SDL_Rect structureRect;
+                structureRect.x = x * CELL_SIZE + 2;
+                structureRect.y = y * CELL_SIZE + CELL_SIZE / 2;
+                structureRect.w = CELL_SIZE - 4;
+                structureRect.h = CELL_SIZE / 2;
+                
+                batch.setColor(130, 130, 100, 255);
+                batch.fillRect(structureRect);
+            }
+            break;
+        }
+        
+        case PARK: {
+            // Draw park with trees and path
+            drawTree(batch, x, y, 2);
+            
+            // Path
+            SDL_Rect pathRect;
+            pathRect.x = x * CELL_SIZE + CELL_SIZE / 4;
+            pathRect.y = y * CELL_SIZE + CELL_SIZE / 2;
+            pathRect.w = CELL_SIZE / 2;
+            pathRect.h = CELL_SIZE / 6;
+            
+            batch.setColor(200, 180, 140, 255);
+            batch.fillRect(pathRect);
+            break;
+        }
+        
+        case FOREST: {
+            // Draw multiple trees for forest
+            drawTree(batch, x, y, 3);
+            break;
+        }
+        
+        case FARM: {
+            // Draw farm fields
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    if ((i + j) % 2 == 0) continue; // Checkerboard pattern
+                    
+                    SDL_Rect fieldRect;
+                    fieldRect.x = x * CELL_SIZE + i * (CELL_SIZE / 3);
+                    fieldRect.y = y * CELL_SIZE + j * (CELL_SIZE / 3);
+                    fieldRect.w = CELL_SIZE / 3;
+                    fieldRect.h = CELL_SIZE / 3;
+                    
+                    // Darker green for planted fields
+                    batch.setColor(100, 180, 60, 255);
+                    batch.fillRect(fieldRect);
+                }
+            }
+            
+            // Small farm house
+            if (building.variant % 2 == 0) {
+                SDL_Rect houseRect;
+                houseRect.x = x * CELL_SIZE + CELL_SIZE / 6;
+                houseRect.y = y * CELL_SIZE + CELL_SIZE / 6;
+                houseRect.w = CELL_SIZE / 3;
+                houseRect.h = CELL_SIZE / 3;
+                
+                batch.setColor(200, 150, 100, 255);
+                batch.fillRect(houseRect);
+            }
+            break;
+        }
+    }
+}
+
+// Draw water at an animation phase
+void drawWater(RenderBatch& batch, int x, int y, int phase) {
+    SDL_Rect waterRect;
+    waterRect.x = x * CELL_SIZE;
+    waterRect.y = y * CELL_SIZE;
+    waterRect.w = CELL_SIZE;
+    waterRect.h = CELL_SIZE;
+    
+    // Use animated water colors
+    SDL_Color waterColor = waterColors[phase];
+    batch.setColor(waterColor.r, waterColor.g, waterColor.b, 255);
+    batch.fillRect(waterRect);
+    
+    // Draw wave lines
+    batch.setColor(waterColor.r + 20, waterColor.g + 20, waterColor.b + 20, 180);
+    for (int i = 0; i < 3; i++) {
+        int yOffset = (i * CELL_SIZE / 3 + phase * 2) % CELL_SIZE;
+        batch.drawLine(
+                       x * CELL_SIZE, y * CELL_SIZE + yOffset,
+                       x * CELL_SIZE + CELL_SIZE, y * CELL_SIZE + yOffset);
+    }
+}
+
+// Connectivity mask of the roads around a cell
+int roadMaskAt(const CitySnapshot& frame, int x, int y) {
+    return frame.roadMasks.get(x, y, 0);
+}
+
+// Draw road
+void drawRoad(RenderBatch& batch, int x, int y, int mask) {
+    SDL_Rect roadRect;
+    roadRect.x = x * CELL_SIZE;
+    roadRect.y = y * CELL_SIZE;
+    roadRect.w = CELL_SIZE;
+    roadRect.h = CELL_SIZE;
+    
+    // Road base
+    batch.setColor(COLOR_ROAD.r, COLOR_ROAD.g, COLOR_ROAD.b, 255);
+    batch.fillRect(roadRect);
+    
+    // Road markings
+    batch.setColor(220, 220, 220, 255);
+    
+    int centerX = x * CELL_SIZE + CELL_SIZE / 2;
+    int centerY = y * CELL_SIZE + CELL_SIZE / 2;
+    
+    switch (mask) {
+        case ROAD_NORTH:
+        case ROAD_SOUTH:
+        case ROAD_NORTH | ROAD_SOUTH:
+            // Vertical road - draw center line
+            batch.drawLine(centerX, y * CELL_SIZE, centerX, y * CELL_SIZE + CELL_SIZE);
+            break;
+        case ROAD_EAST:
+        case ROAD_WEST:
+        case ROAD_EAST | ROAD_WEST:
+            // Horizontal road - draw center line
+            batch.drawLine(x * CELL_SIZE, centerY, x * CELL_SIZE + CELL_SIZE, centerY);
+            break;
+        case 0: {
+            // Isolated road - draw a small square in the middle
+            SDL_Rect centerRect;
+            centerRect.x = x * CELL_SIZE + CELL_SIZE / 3;
+            centerRect.y = y * CELL_SIZE + CELL_SIZE / 3;
+            centerRect.w = CELL_SIZE / 3;
+            centerRect.h = CELL_SIZE / 3;
+            batch.fillRect(centerRect);
+            break;
+        }
+        default:
+            // Corner or intersection - draw crossing lines
+            batch.drawLine(centerX, y * CELL_SIZE, centerX, y * CELL_SIZE + CELL_SIZE);
+            batch.drawLine(x * CELL_SIZE, centerY, x * CELL_SIZE + CELL_SIZE, centerY);
+            break;
+    }
+}
+
+// Draw tree
+void drawTree(RenderBatch& batch, int x, int y, int size) {
+    SDL_Rect trunkRect;
+    if (size == 1) {
+        // Single small tree
+        trunkRect.x = x * CELL_SIZE + CELL_SIZE * 3 / 4;
+        trunkRect.y = y * CELL_SIZE + CELL_SIZE * 2 / 3;
+        trunkRect.w = CELL_SIZE / 8;
+        trunkRect.h = CELL_SIZE / 4;
+        
+        batch.setColor(120, 80, 40, 255);
+        batch.fillRect(trunkRect);
+        
+        // Tree top
+        batch.setColor(40, 160, 40, 255);
+        SDL_Rect leafRect;
+        leafRect.x = x * CELL_SIZE + CELL_SIZE * 2 / 3;
+        leafRect.y = y * CELL_SIZE + CELL_SIZE / 2;
+        leafRect.w = CELL_SIZE / 4;
+        leafRect.h = CELL_SIZE / 4;
+        batch.fillRect(leafRect);
+    } else if (size == 2) {
+        // Medium park tree
+        trunkRect.x = x * CELL_SIZE + CELL_SIZE / 2 - CELL_SIZE / 10;
+        trunkRect.y = y * CELL_SIZE + CELL_SIZE / 2;
+        trunkRect.w = CELL_SIZE / 5;
+        trunkRect.h = CELL_SIZE / 3;
+        
+        batch.setColor(120, 80, 40, 255);
+        batch.fillRect(trunkRect);
+        
+        // Tree top
+        batch.setColor(40, 180, 40, 255);
+        // Filled circle, one horizontal span per row
+        int radius = CELL_SIZE / 3;
+        for (int dy = -radius; dy <= radius; dy++) {
+            int span = 0;
+            while ((span + 1) * (span + 1) + dy * dy <= radius * radius) span++;
+            SDL_Rect spanRect = {x * CELL_SIZE + CELL_SIZE / 2 - span, y * CELL_SIZE + CELL_SIZE / 3 + dy,
+                                 2 * span + 1, 1};
+            batch.fillRect(spanRect);
+        }
+    } else {
+        // Forest - multiple trees
+        // First tree
+        trunkRect.x = x * CELL_SIZE + CELL_SIZE / 3;
+        trunkRect.y = y * CELL_SIZE + CELL_SIZE / 2;
+        trunkRect.w = CELL_SIZE / 8;
+        trunkRect.h = CELL_SIZE / 3;
+        
+        batch.setColor(100, 70, 30, 255);
+        batch.fillRect(trunkRect);
+        
+        batch.setColor(30, 130, 30, 255);
+        SDL_Rect leaf1Rect;
+        leaf1Rect.x = x * CELL_SIZE + CELL_SIZE / 4;
+        leaf1Rect.y = y * CELL_SIZE + CELL_SIZE / 4;
+        leaf1Rect.w = CELL_SIZE / 4;
+        leaf1Rect.h = CELL_SIZE / 4;
+        batch.fillRect(leaf1Rect);
+        
+        // Second tree
+        trunkRect.x = x * CELL_SIZE + CELL_SIZE * 2 / 3;
+        trunkRect.y = y * CELL_SIZE + CELL_SIZE * 2 / 3;
+        trunkRect.w = CELL_SIZE / 8;
+        trunkRect.h = CELL_SIZE / 4;
+        
+        batch.setColor(110, 75, 35, 255);
+        batch.fillRect(trunkRect);
+        
+        batch.setColor(35, 140, 35, 255);
+        SDL_Rect leaf2Rect;
+        leaf2Rect.x = x * CELL_SIZE + CELL_SIZE * 3 / 5;
+        leaf2Rect.y = y * CELL_SIZE + CELL_SIZE / 2;
+        leaf2Rect.w = CELL_SIZE / 4;
+        leaf2Rect.h = CELL_SIZE / 4;
+        batch.fillRect(leaf2Rect);
+    }
+}
+
+// Perform one simulation step
+void simulationStep() {
+    ScopedPhaseTimer timer("simulationStep", &city->phaseTimings.step);
+    
+    // Move cars
+    updateCars();
+    
+    // Only grow the city every few steps to slow down development
+    if (city->currentStep % 3 == 0) {
+        growCity();
+    }
+    
+    city->currentStep++;
+}
+
+// Cell types the perf HUD counts as buildings
+bool isBuildingType(CellType type) {
+    return type == RESIDENTIAL || type == COMMERCIAL || type == INDUSTRIAL ||
+           type == PARK || type == POWER_PLANT || type == GOVERNMENT;
+}
+
+// Fill every snapshot buffer from the current state, after the city was (re)initialized
+void resetSnapshots() {
+    int buildingCount = 0;
+    for (int i = 0; i < city->gridWidth * city->gridHeight; i++) {
+        buildingCount += isBuildingType(city->grid.data()[i]);
+    }
+    
+    for (int s = 0; s < SnapshotExchange::SLOTS; s++) {
+        CitySnapshot& snapshot = snapshots.slot(s);
+        snapshot.grid = city->grid;
+        snapshot.buildings = city->buildings;
+        snapshot.roadMasks = city->roadMasks;
+        snapshot.waterCells = city->waterCells;
+        snapshot.carX = city->cars.x;
+        snapshot.carY = city->cars.y;
+        snapshot.carPrevX = city->cars.prevX;
+        snapshot.carPrevY = city->cars.prevY;
+        snapshot.carColors = city->cars.color;
+        snapshot.step = city->currentStep;
+        snapshot.publishedAt = SDL_GetTicks();
+        snapshot.timings = PhaseTimings();
+        snapshot.roadCount = static_cast<int>(city->roads.size());
+        snapshot.buildingCount = buildingCount;
+        staleSnapshotCells[s].reset(city->gridWidth * city->gridHeight);
+    }
+    snapshots.reset();
+    city->dirtyCells.clear();
+    snapshotDirtyCells.reset(city->gridWidth * city->gridHeight);
+    std::lock_guard<std::mutex> lock(snapshotChangesMutex);
+    snapshotChanges.clear();
+}
+
+// Copy into a snapshot buffer. Capacity grows geometrically, a plain copy would reallocate
+// to the exact size every time the car count goes up by one.
+template <typename T>
+void copyGrowing(std::vector<T>& target, const std::vector<T>& source) {
+    if (source.size() > target.capacity()) {
+        target.reserve(std::max(source.size(), target.capacity() * 2));
+    }
+    target.assign(source.begin(), source.end());
+}
+
+// Bring the back buffer up to date and publish it. Only cells changed since that buffer was
+// last filled are copied, so the cost follows the amount of growth rather than the map size.
+void publishSnapshot() {
+    ScopedPhaseTimer timer("publishSnapshot");
+    for (int s = 0; s < SnapshotExchange::SLOTS; s++) {
+        for (int i = 0; i < city->dirtyCells.size(); i++) {
+            staleSnapshotCells[s].insert(city->dirtyCells[i]);
+        }
+    }
+    
+    CitySnapshot& snapshot = snapshots.backBuffer();
+    CellSet& stale = staleSnapshotCells[snapshots.backIndex()];
+    for (int i = 0; i < stale.size(); i++) {
+        int x = stale[i] % city->gridWidth;
+        int y = stale[i] / city->gridWidth;
+        snapshot.buildingCount += isBuildingType(city->grid(x, y)) - isBuildingType(snapshot.grid(x, y));
+        snapshot.grid(x, y) = city->grid(x, y);
+        snapshot.buildings(x, y) = city->buildings(x, y);
+        snapshot.roadMasks(x, y) = city->roadMasks(x, y);
+    }
+    stale.clear();
+    
+    // Water cells are only ever added during terrain generation
+    if (snapshot.waterCells.size() != city->waterCells.size()) {
+        snapshot.waterCells = city->waterCells;
+    }
+    copyGrowing(snapshot.carX, city->cars.x);
+    copyGrowing(snapshot.carY, city->cars.y);
+    copyGrowing(snapshot.carPrevX, city->cars.prevX);
+    copyGrowing(snapshot.carPrevY, city->cars.prevY);
+    copyGrowing(snapshot.carColors, city->cars.color);
+    snapshot.step = city->currentStep;
+    snapshot.publishedAt = SDL_GetTicks();
+    snapshot.timings = city->phaseTimings;
+    snapshot.roadCount = static_cast<int>(city->roads.size());
+    
+    // Queued before publishing, so the renderer always finds the changes of a snapshot it takes
+    if (city->dirtyCells.size() > 0) {
+        std::lock_guard<std::mutex> lock(snapshotChangesMutex);
+        SnapshotChanges changes = {city->currentStep, std::vector<int>()};
+        if (!spareChangeLists.empty()) {
+            changes.cells.swap(spareChangeLists.back());
+            spareChangeLists.pop_back();
+        }
+        for (int i = 0; i < city->dirtyCells.size(); i++) {
+            changes.cells.push_back(city->dirtyCells[i]);
+        }
+        city->dirtyCells.clear();
+        snapshotChanges.push_back(std::move(changes));
+    }
+    snapshots.publish();
+}
+
+// Take the newest published snapshot and collect the cells that changed up to its step.
+// Returns false if nothing new was published.
+bool acquireSnapshot() {
+    if (!snapshots.acquire()) return false;
+    
+    int step = snapshots.frontBuffer().step;
+    std::lock_guard<std::mutex> lock(snapshotChangesMutex);
+    while (!snapshotChanges.empty() && snapshotChanges.front().step <= step) {
+        std::vector<int>& cells = snapshotChanges.front().cells;
+        for (int cell : cells) {
+            snapshotDirtyCells.insert(cell);
+        }
+        cells.clear();
+        spareChangeLists.push_back(std::move(cells));
+        snapshotChanges.pop_front();
+    }
+    return true;
+}
+
+// Simulation thread in interactive mode: fixed steps on their own clock, one snapshot per step
+void runSimulationThread() {
+    city = &mainCity;
+    traceRecorder.nameThread("simulation");
+    Uint32 previousTime = SDL_GetTicks();
+    Uint32 accumulator = 0;
+    
+    while (!simulationStopping && city->currentStep < MAX_SIMULATION_STEPS) {
+        Uint32 now = SDL_GetTicks();
+        accumulator += now - previousTime;
+        previousTime = now;
+        
+        int steps = 0;
+        while (accumulator >= SIMULATION_DELAY && steps < MAX_STEPS_PER_FRAME &&
+               city->currentStep < MAX_SIMULATION_STEPS && !simulationStopping) {
+            // Timings restart every step, each snapshot carries those of its own step
+            city->phaseTimings = PhaseTimings();
+            simulationStep();
+            publishSnapshot();
+            accumulator -= SIMULATION_DELAY;
+            steps++;
+        }
+        if (steps == MAX_STEPS_PER_FRAME) {
+            accumulator %= SIMULATION_DELAY;
+        }
+        checkAutoSave();
+        
+        // Wake the render loop if it is idling in SDL_WaitEventTimeout
+        if (steps > 0 && snapshotEventType != static_cast<Uint32>(-1)) {
+            SDL_Event event;
+            SDL_zero(event);
+            event.type = snapshotEventType;
+            SDL_PushEvent(&event);
+        }
+        
+        // Sleep until the next step is due, or until asked to stop or save
+        std::unique_lock<std::mutex> lock(simulationMutex);
+        simulationWake.wait_for(lock, std::chrono::milliseconds(SIMULATION_DELAY - accumulator), [] {
+            return simulationStopping || (saveRequested && !saveWriter.busy());
+        });
+    }
+    simulationFinished = true;
+}
+
+// Append a raw array as the given section of a save image, 8-byte aligned
+template <typename T>
+void appendSaveSection(std::vector<char>& image, SaveSection id, const T* data, size_t count) {
+    static_assert(std::is_trivially_copyable<T>::value, "Save sections hold raw arrays");
+    size_t offset = (image.size() + 7) & ~static_cast<size_t>(7);
+    size_t bytes = count * sizeof(T);
+    image.resize(offset + bytes);
+    if (bytes > 0) {
+        std::memcpy(&image[offset], data, bytes);
+    }
+    SaveSectionEntry entry = {offset, bytes};
+    std::memcpy(&image[sizeof(SaveHeader) + id * sizeof(SaveSectionEntry)], &entry, sizeof(entry));
+}
+
+// Road and water cell lists are stored as interleaved x, y ints
+void appendCellListSection(std::vector<char>& image, SaveSection id, const std::vector<std::pair<int, int>>& cells) {
+    std::vector<int> flat;
+    flat.reserve(cells.size() * 2);
+    for (const auto& [x, y] : cells) {
+        flat.push_back(x);
+        flat.push_back(y);
+    }
+    appendSaveSection(image, id, flat.data(), flat.size());
+}
+
+// Bring saveImage up to date with the city. The grid sections keep their offsets from one save
+// to the next, so only the cells changed since are copied; the variable-length tail is rebuilt.
+void updateSaveImage() {
+    size_t cellCount = static_cast<size_t>(city->gridWidth) * city->gridHeight;
+    if (saveImage.empty() || saveImageCells != cellCount) {
+        saveImage.assign(SAVE_TABLE_END, 0);
+        appendSaveSection(saveImage, SAVE_GRID, city->grid.data(), cellCount);
+        appendSaveSection(saveImage, SAVE_BUILDINGS, city->buildings.data(), cellCount);
+        saveImageCells = cellCount;
+    } else {
+        const SaveSectionEntry* table = reinterpret_cast<const SaveSectionEntry*>(&saveImage[sizeof(SaveHeader)]);
+        for (int i = 0; i < city->unsavedCells.size(); i++) {
+            int cell = city->unsavedCells[i];
+            std::memcpy(&saveImage[table[SAVE_GRID].offset + cell * sizeof(CellType)], &city->grid.data()[cell], sizeof(CellType));
+            std::memcpy(&saveImage[table[SAVE_BUILDINGS].offset + cell * sizeof(Building)], &city->buildings.data()[cell], sizeof(Building));
+        }
+        saveImage.resize(table[SAVE_BUILDINGS].offset + table[SAVE_BUILDINGS].size);
+    }
+    city->unsavedCells.clear();
+    
+    appendCellListSection(saveImage, SAVE_ROADS, city->roads);
+    appendCellListSection(saveImage, SAVE_WATER, city->waterCells);
+    appendSaveSection(saveImage, SAVE_BUILDING_SPOTS, city->buildingSpots.members().data(), city->buildingSpots.size());
+    appendSaveSection(saveImage, SAVE_ROAD_SPOTS, city->roadSpots.members().data(), city->roadSpots.size());
+    
+    size_t carCount = city->cars.size();
+    appendSaveSection(saveImage, SAVE_CAR_X, city->cars.x.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_Y, city->cars.y.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_PREV_X, city->cars.prevX.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_PREV_Y, city->cars.prevY.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_SPEED, city->cars.speed.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_DIRECTION, city->cars.direction.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_ROAD, city->cars.roadIndex.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_COLOR, city->cars.color.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_WAIT, city->cars.wait.data(), carCount);
+    appendSaveSection(saveImage, SAVE_CAR_DESTINATION, city->cars.destination.data(), carCount);
+    appendSaveSection(saveImage, SAVE_HOMES, city->homes.data(), city->homes.size());
+    appendSaveSection(saveImage, SAVE_WORKPLACES, city->workplaces.data(), city->workplaces.size());
+    
+    std::vector<Rng::State> streams = {city->terrainRng.getState(), city->roadRng.getState(), city->growthRng.getState(), city->carRng.getState()};
+    std::vector<int> wheelCounts;
+    std::vector<int> wheelEvents;
+    for (const SimTile& tile : city->simTiles) {
+        streams.push_back(tile.rng.getState());
+        for (int slot = 0; slot < TimingWheel::SLOTS; slot++) {
+            const std::vector<int>& events = tile.wheel.slotEvents(slot);
+            wheelCounts.push_back(static_cast<int>(events.size()));
+            wheelEvents.insert(wheelEvents.end(), events.begin(), events.end());
+        }
+    }
+    appendSaveSection(saveImage, SAVE_RNG, streams.data(), streams.size());
+    appendSaveSection(saveImage, SAVE_WHEEL_COUNTS, wheelCounts.data(), wheelCounts.size());
+    appendSaveSection(saveImage, SAVE_WHEEL_EVENTS, wheelEvents.data(), wheelEvents.size());
+    
+    SaveHeader header;
+    std::memcpy(header.magic, SAVE_MAGIC, sizeof(header.magic));
+    header.version = SAVE_VERSION;
+    header.byteOrder = SAVE_BYTE_ORDER;
+    header.width = city->gridWidth;
+    header.height = city->gridHeight;
+    header.tileCells = TILE_CELLS;
+    header.currentStep = city->currentStep;
+    header.growthTick = city->growthTick;
+    header.sectionCount = SAVE_SECTION_COUNT;
+    std::memcpy(&saveImage[0], &header, sizeof(header));
+}
+
+// Save the city in the background, returns false if the previous save is still being written
+bool saveCity(const std::string& path) {
+    if (saveWriter.busy()) return false;
+    updateSaveImage();
+    saveWriter.submit(&saveImage, path);
+    lastSaveStep = city->currentStep;
+    return true;
+}
+
+// Between steps: save if the key was pressed or the save interval elapsed. A save that finds
+// the writer busy stays requested and is retried after the next step.
+void checkAutoSave() {
+    if (savePath.empty()) return;
+    bool due = saveRequested || (saveInterval > 0 && city->currentStep - lastSaveStep >= saveInterval);
+    if (due && saveCity(savePath)) {
+        saveRequested = false;
+    }
+}
+
+// Locate a section of a mapped save file, returns false if it lies outside the file
+// or doesn't hold a whole number of elements
+template <typename T>
+bool findSaveSection(const char* bytes, size_t size, SaveSection id, const T*& data, size_t& count) {
+    SaveSectionEntry entry;
+    std::memcpy(&entry, bytes + sizeof(SaveHeader) + id * sizeof(SaveSectionEntry), sizeof(entry));
+    if (entry.offset % 8 != 0 || entry.offset > size || entry.size > size - entry.offset || entry.size % sizeof(T) != 0) {
+        return false;
+    }
+    data = reinterpret_cast<const T*>(bytes + entry.offset);
+    count = entry.size / sizeof(T);
+    return true;
+}
+
+// Copy a section into a vector of any length
+template <typename T>
+bool readSaveSection(const char* bytes, size_t size, SaveSection id, std::vector<T>& out) {
+    const T* data;
+    size_t count;
+    if (!findSaveSection(bytes, size, id, data, count)) return false;
+    out.resize(count);
+    if (count > 0) {
+        std::memcpy(out.data(), data, count * sizeof(T));
+    }
+    return true;
+}
+
+// Copy a section that must hold exactly count elements
+template <typename T>
+bool readSaveSection(const char* bytes, size_t size, SaveSection id, T* out, size_t count) {
+    const T* data;
+    size_t found;
+    if (!findSaveSection(bytes, size, id, data, found) || found != count) return false;
+    if (count > 0) {
+        std::memcpy(out, data, count * sizeof(T));
+    }
+    return true;
+}
+
+// Replace the city with the one in a save file image. Indices that would reach outside
+// the grid or the road list, road and spot lists that don't match the grid, and maturation
+// events in the wrong tile are rejected, so a damaged file can't corrupt memory.
+bool restoreCity(const char* bytes, size_t size) {
+    SaveHeader header;
+    if (size < SAVE_TABLE_END) {
+        std::cerr << "Save file is truncated" << std::endl;
+        return false;
+    }
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::memcmp(header.magic, SAVE_MAGIC, sizeof(header.magic)) != 0) {
+        std::cerr << "Not a city save file" << std::endl;
+        return false;
+    }
+    if (header.byteOrder != SAVE_BYTE_ORDER || header.version != SAVE_VERSION ||
+        header.sectionCount != SAVE_SECTION_COUNT || header.tileCells != TILE_CELLS) {
+        std::cerr << "Save file was written by an incompatible version (format " << header.version << ")" << std::endl;
+        return false;
+    }
+    if (header.width < MIN_GRID_SIZE || header.height < MIN_GRID_SIZE ||
+        header.width > MAX_GRID_SIZE || header.height > MAX_GRID_SIZE || header.currentStep < 0) {
+        std::cerr << "Save file header is invalid" << std::endl;
+        return false;
+    }
+    
+    city->gridWidth = header.width;
+    city->gridHeight = header.height;
+    resetCityState();
+    city->currentStep = header.currentStep;
+    city->growthTick = header.growthTick;
+    int cellCount = city->gridWidth * city->gridHeight;
+    
+    std::vector<int> roadCells, water, spots, candidates;
+    std::vector<Rng::State> streams;
+    std::vector<int> wheelCounts, wheelEvents;
+    bool ok = readSaveSection(bytes, size, SAVE_GRID, city->grid.data(), cellCount) &&
+              readSaveSection(bytes, size, SAVE_BUILDINGS, city->buildings.data(), cellCount) &&
+              readSaveSection(bytes, size, SAVE_ROADS, roadCells) &&
+              readSaveSection(bytes, size, SAVE_WATER, water) &&
+              readSaveSection(bytes, size, SAVE_BUILDING_SPOTS, spots) &&
+              readSaveSection(bytes, size, SAVE_ROAD_SPOTS, candidates) &&
+              readSaveSection(bytes, size, SAVE_CAR_X, city->cars.x) &&
+              readSaveSection(bytes, size, SAVE_HOMES, city->homes) &&
+              readSaveSection(bytes, size, SAVE_WORKPLACES, city->workplaces) &&
+              readSaveSection(bytes, size, SAVE_RNG, streams) &&
+              readSaveSection(bytes, size, SAVE_WHEEL_COUNTS, wheelCounts) &&
+              readSaveSection(bytes, size, SAVE_WHEEL_EVENTS, wheelEvents);
+    size_t carCount = city->cars.x.size();
+    city->cars.y.resize(carCount);
+    city->cars.prevX.resize(carCount);
+    city->cars.prevY.resize(carCount);
+    city->cars.speed.resize(carCount);
+    city->cars.direction.resize(carCount);
+    city->cars.roadIndex.resize(carCount);
+    city->cars.color.resize(carCount);
+    city->cars.wait.resize(carCount);
+    city->cars.destination.resize(carCount);
+    ok = ok && readSaveSection(bytes, size, SAVE_CAR_Y, city->cars.y.data(), carCount) &&
+         readSaveSection(bytes, size, SAVE_CAR_PREV_X, city->cars.prevX.data(), carCount) &&
+         readSaveSection(bytes, size, SAVE_CAR_PREV_Y, city->cars.prevY.data(), carCount) &&
+         readSaveSection(bytes, size, SAVE_CAR_SPEED, city->cars.speed.data(), carCount) &&
+         readSaveSection(bytes, size, SAVE_CAR_DIRECTION, city->cars.direction.data(), carCount) &&
+         readSaveSection(bytes, size, SAVE_CAR_ROAD, city->cars.roadIndex.data(), carCount) &&
+         readSaveSection(bytes, size, SAVE_CAR_COLOR, city->cars.color.data(), carCount) &&
+         readSaveSection(bytes, size, SAVE_CAR_WAIT, city->cars.wait.data(), carCount) &&
+         readSaveSection(bytes, size, SAVE_CAR_DESTINATION, city->cars.destination.data(), carCount);
+    ok = ok && roadCells.size() % 2 == 0 && water.size() % 2 == 0 &&
+         streams.size() == 4 + city->simTiles.size() && wheelCounts.size() == city->simTiles.size() * TimingWheel::SLOTS;
+    if (!ok) {
+        std::cerr << "Save file sections are missing or have the wrong size" << std::endl;
+        return false;
+    }
+    
+    // Validate everything later used as an index
+    size_t roadCellCount = 0;
+    for (int cell = 0; cell < cellCount; cell++) {
+        if (city->grid.data()[cell] >= CELL_TYPE_COUNT || city->buildings.data()[cell].type >= CELL_TYPE_COUNT) ok = false;
+        if (city->grid.data()[cell] == ROAD) roadCellCount++;
+    }
+    // Every ROAD cell must be listed exactly once, routing indexes by roadIds
+    for (size_t i = 0; i < roadCells.size(); i += 2) {
+        if (!isValidCell(roadCells[i], roadCells[i + 1]) || city->grid(roadCells[i], roadCells[i + 1]) != ROAD ||
+            city->roadIds(roadCells[i], roadCells[i + 1]) != -1) {
+            ok = false;
+            break;
+        }
+        city->roadIds(roadCells[i], roadCells[i + 1]) = static_cast<int>(city->roads.size());
+        city->roads.push_back({roadCells[i], roadCells[i + 1]});
+    }
+    if (city->roads.size() != roadCellCount) ok = false;
+    for (size_t i = 0; i < water.size(); i += 2) {
+        if (!isValidCell(water[i], water[i + 1])) ok = false;
+        city->waterCells.push_back({water[i], water[i + 1]});
+    }
+    // Spots are saved for their sampling order but must match a fresh scan of the grid, or a
+    // building could be placed over a road
+    rebuildRoadMasks();
+    int spotCount = 0;
+    int candidateCount = 0;
+    for (int cell = 0; cell < cellCount; cell++) {
+        int x = cell % city->gridWidth;
+        int y = cell / city->gridWidth;
+        if (isBuildingSpot(x, y)) spotCount++;
+        if (isRoadSpot(x, y)) candidateCount++;
+    }
+    for (int cell : spots) {
+        if (cell < 0 || cell >= cellCount || !isBuildingSpot(cell % city->gridWidth, cell / city->gridWidth)) {
+            ok = false;
+            break;
+        }
+        city->buildingSpots.insert(cell);
+    }
+    for (int cell : candidates) {
+        if (cell < 0 || cell >= cellCount || !isRoadSpot(cell % city->gridWidth, cell / city->gridWidth)) {
+            ok = false;
+            break;
+        }
+        city->roadSpots.insert(cell);
+    }
+    // Duplicates were inserted once, so the sizes also catch those
+    if (city->buildingSpots.size() != spotCount || static_cast<size_t>(spotCount) != spots.size() ||
+        city->roadSpots.size() != candidateCount || static_cast<size_t>(candidateCount) != candidates.size()) ok = false;
+    for (int cell : city->homes) {
+        if (cell < 0 || cell >= cellCount) ok = false;
+    }
+    for (int cell : city->workplaces) {
+        if (cell < 0 || cell >= cellCount) ok = false;
+    }
+    int destinationCount = 2 * ((city->gridWidth + REGION_CELLS - 1) / REGION_CELLS) * ((city->gridHeight + REGION_CELLS - 1) / REGION_CELLS);
+    for (size_t i = 0; i < carCount; i++) {
+        if (city->cars.direction[i] >= 4 || city->cars.roadIndex[i] < 0 || static_cast<size_t>(city->cars.roadIndex[i]) >= city->roads.size() ||
+            city->cars.destination[i] < -1 || city->cars.destination[i] >= destinationCount) ok = false;
+    }
+    size_t eventTotal = 0;
+    for (int count : wheelCounts) {
+        if (count < 0) ok = false;
+        eventTotal += count;
+    }
+    if (eventTotal != wheelEvents.size()) ok = false;
+    // Tiles mature in parallel, so an event must sit in the wheel of the tile owning its cell
+    size_t event = 0;
+    for (size_t t = 0; ok && t < city->simTiles.size(); t++) {
+        for (int slot = 0; slot < TimingWheel::SLOTS; slot++) {
+            for (int k = 0; k < wheelCounts[t * TimingWheel::SLOTS + slot]; k++, event++) {
+                int cell = wheelEvents[event] / 2;
+                if (wheelEvents[event] < 0 || cell >= cellCount || tileOf(cell) != static_cast<int>(t)) ok = false;
+            }
+        }
+    }
+    if (!ok) {
+        std::cerr << "Save file contents are damaged" << std::endl;
+        return false;
+    }
+    
+    // Derived from the grid, so it is rebuilt rather than stored and trusted
+    city->cellBits.rebuild(city->grid);
+    city->cars.velX.resize(carCount);
+    city->cars.velY.resize(carCount);
+    for (size_t i = 0; i < carCount; i++) {
+        city->cars.setDirection(i, city->cars.direction[i]);
+    }
+    
+    city->terrainRng.setState(streams[0]);
+    city->roadRng.setState(streams[1]);
+    city->growthRng.setState(streams[2]);
+    city->carRng.setState(streams[3]);
+    size_t next = 0;
+    for (size_t t = 0; t < city->simTiles.size(); t++) {
+        city->simTiles[t].rng.setState(streams[4 + t]);
+        for (int slot = 0; slot < TimingWheel::SLOTS; slot++) {
+            int count = wheelCounts[t * TimingWheel::SLOTS + slot];
+            city->simTiles[t].wheel.slotEvents(slot).assign(wheelEvents.begin() + next, wheelEvents.begin() + next + count);
+            next += count;
+        }
+    }
+    lastSaveStep = city->currentStep;
+    return true;
+}
+
+// Load a save file through a read-only memory mapping
+bool loadCity(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Could not open save file " << path << std::endl;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        std::cerr << "Save file " << path << " is empty" << std::endl;
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Could not map save file " << path << std::endl;
+        return false;
+    }
+    
+    bool loaded = restoreCity(static_cast<const char*>(mapping), size);
+    munmap(mapping, size);
+    return loaded;
+}
+
+// Reduce a building to the fields that affect how it is drawn
+Building buildingVisualForm(const Building& building) {
+    Building visual = {building.type, building.density, building.style, building.variant,
+                       building.hasTree, false};
+    switch (building.type) {
+        case RESIDENTIAL:
+        case COMMERCIAL:
+            break;
+        case INDUSTRIAL:
+            visual.style = BASIC;
+            visual.hasTree = false;
+            break;
+        case PARK:
+        case FOREST:
+        case FARM:
+            visual.style = BASIC;
+            visual.density = 0;
+            visual.hasTree = false;
+            break;
+        default:
+            visual.style = BASIC;
+            visual.variant = 0;
+            visual.density = 0;
+            visual.hasTree = false;
+    }
+    return visual;
+}
+
+// Pack a building's visual form into an atlas lookup key, -1 if it cannot be represented
+int buildingVisualId(const Building& visual) {
+    if (visual.style > 3 || visual.variant > 7 || visual.density > 3) return -1;
+    return visual.type | visual.style << 4 | visual.variant << 6 | visual.density << 9 |
+           (visual.hasTree ? 1 : 0) << 11;
+}
+
+// Assign an atlas slot to every building appearance the simulation can produce
+void buildSpriteLayout() {
+    std::fill(std::begin(buildingSprites), std::end(buildingSprites), -1);
+    buildingSpriteSources.clear();
+    
+    const CellType types[] = {RESIDENTIAL, COMMERCIAL, INDUSTRIAL, PARK, POWER_PLANT, GOVERNMENT, FOREST, FARM};
+    for (CellType type : types) {
+        for (int style = 0; style < 4; style++) {
+            for (int variant = 0; variant < 5; variant++) {
+                for (int density = 1; density <= 3; density++) {
+                    for (int tree = 0; tree < 2; tree++) {
+                        Building building = {type, static_cast<Uint8>(density), static_cast<BuildingStyle>(style),
+                                             static_cast<Uint8>(variant), tree == 1, false};
+                        Building visual = buildingVisualForm(building);
+                        int id = buildingVisualId(visual);
+                        if (buildingSprites[id] >= 0) continue;
                         
-                        SDL_SetRenderDrawColor(renderer, 220, 230, 250, 255);
-                        SDL_RenderFillRect(renderer, &windowRect);
+                        buildingSprites[id] = static_cast<Sint16>(SPRITE_BUILDING_BASE + buildingSpriteSources.size());
+                        buildingSpriteSources.push_back(visual);
                     }
                 }
-            } else {
-                // Tall apartment building
-                for (int i = 0; i < 3; i++) {
-                    SDL_Rect windowRowRect;
-                    windowRowRect.x = x * CELL_SIZE + 2;
-                    windowRowRect.y = y * CELL_SIZE + 2 + i * (CELL_SIZE / 3);
-                    windowRowRect.w = CELL_SIZE - 4;
-                    windowRowRect.h = 2;
-                    
-                    SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
-                    SDL_RenderFillRect(renderer, &windowRowRect);
-                }
-            }
-            
-            // Draw tree if present
-            if (building.hasTree) {
-                drawTree(renderer, x, y, 1);
             }
-            break;
         }
+    }
+}
+
+// Rasterize all sprites into the atlas texture using the regular draw helpers.
+// Each slot is a CELL_SIZE tile, so slot (col, row) is drawn like grid cell (col, row).
+bool bakeSpriteAtlas(SDL_Renderer* renderer) {
+    if (buildingSpriteSources.empty()) {
+        buildSpriteLayout();
+    }
+    
+    int spriteCount = SPRITE_BUILDING_BASE + buildingSpriteSources.size();
+    if (spriteAtlas == nullptr) {
+        int rows = (spriteCount + ATLAS_COLUMNS - 1) / ATLAS_COLUMNS;
+        spriteAtlas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                        ATLAS_COLUMNS * CELL_SIZE, rows * CELL_SIZE);
+        if (spriteAtlas == nullptr) {
+            std::cerr << "Sprite atlas could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+            return false;
+        }
+    }
+    
+    SDL_SetRenderTarget(renderer, spriteAtlas);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    
+    RenderBatch& batch = renderBatch;
+    batch.begin(renderer);
+    for (int slot = 0; slot < spriteCount; slot++) {
+        int col = slot % ATLAS_COLUMNS;
+        int row = slot / ATLAS_COLUMNS;
         
-        case COMMERCIAL: {
-            // Commercial building details
-            if (building.density == 1) {
-                // Small shop
-                SDL_Rect signRect;
-                signRect.x = x * CELL_SIZE + 2;
-                signRect.y = y * CELL_SIZE + 2;
-                signRect.w = CELL_SIZE - 4;
-                signRect.h = 4;
-                
-                SDL_SetRenderDrawColor(renderer, 220, 220, 100, 255);
-                SDL_RenderFillRect(renderer, &signRect);
-                
-                // Window/door
-                SDL_Rect windowRect;
-                windowRect.x = x * CELL_SIZE + CELL_SIZE / 4;
-                windowRect.y = y * CELL_SIZE + CELL_SIZE / 2;
-                windowRect.w = CELL_SIZE / 2;
-                windowRect.h = CELL_SIZE / 3;
-                
-                SDL_SetRenderDrawColor(renderer, 200, 220, 240, 255);
-                SDL_RenderFillRect(renderer, &windowRect);
-            } else if (building.density == 2) {
-                // Medium commercial building
-                // Windows grid
-                for (int i = 0; i < 2; i++) {
-                    for (int j = 0; j < 3; j++) {
-                        SDL_Rect windowRect;
-                        windowRect.x = x * CELL_SIZE + 2 + i * (CELL_SIZE / 2 - 2);
-                        windowRect.y = y * CELL_SIZE + 2 + j * (CELL_SIZE / 3 - 1);
-                        windowRect.w = CELL_SIZE / 3;
-                        windowRect.h = CELL_SIZE / 6;
-                        
-                        SDL_SetRenderDrawColor(renderer, 180, 210, 240, 255);
-                        SDL_RenderFillRect(renderer, &windowRect);
-                    }
-                }
-            } else {
-                // Office building
-                for (int i = 0; i < 4; i++) {
-                    SDL_Rect windowRowRect;
-                    windowRowRect.x = x * CELL_SIZE + 2;
-                    windowRowRect.y = y * CELL_SIZE + 2 + i * (CELL_SIZE / 4);
-                    windowRowRect.w = CELL_SIZE - 4;
-                    windowRowRect.h = CELL_SIZE / 8;
-                    
-                    SDL_SetRenderDrawColor(renderer, 150, 200, 240, 255);
-                    SDL_RenderFillRect(renderer, &windowRowRect);
-                }
+        // Clip to the tile so road markings do not bleed into the next sprite
+        SDL_Rect tileRect = {col * CELL_SIZE, row * CELL_SIZE, CELL_SIZE, CELL_SIZE};
+        batch.setClip(&tileRect);
+        
+        if (slot == SPRITE_EMPTY) {
+            batch.setColor(COLOR_EMPTY.r, COLOR_EMPTY.g, COLOR_EMPTY.b, 255);
+            batch.fillRect(tileRect);
+        } else if (slot == SPRITE_WATER_BASE) {
+            // Water is animated and drawn on top every frame, the static layer keeps it black
+            batch.setColor(0, 0, 0, 255);
+            batch.fillRect(tileRect);
+        } else if (slot < SPRITE_WATER_PHASE_BASE) {
+            drawRoad(batch, col, row, slot - SPRITE_ROAD_BASE);
+        } else if (slot < SPRITE_BUILDING_BASE) {
+            drawWater(batch, col, row, slot - SPRITE_WATER_PHASE_BASE);
+        } else {
+            drawBuilding(batch, col, row, buildingSpriteSources[slot - SPRITE_BUILDING_BASE]);
+        }
+    }
+    batch.setClip(nullptr);
+    batch.flush();
+    
+    SDL_SetRenderTarget(renderer, nullptr);
+    spriteAtlasValid = true;
+    return true;
+}
+
+// Atlas slot showing the static part of a cell, -1 if it has no sprite
+int cellSprite(const CitySnapshot& frame, int x, int y) {
+    switch (frame.grid(x, y)) {
+        case EMPTY:
+            return SPRITE_EMPTY;
+        case WATER:
+            return SPRITE_WATER_BASE;
+        case ROAD:
+            return SPRITE_ROAD_BASE + roadMaskAt(frame, x, y);
+        default: {
+            int id = buildingVisualId(buildingVisualForm(frame.buildings(x, y)));
+            return id >= 0 ? buildingSprites[id] : -1;
+        }
+    }
+}
+
+// Draw the static part of a single cell (everything except water and cars)
+void drawStaticCell(RenderBatch& batch, const CitySnapshot& frame, int x, int y) {
+    if (spriteAtlasValid) {
+        int slot = cellSprite(frame, x, y);
+        if (slot >= 0) {
+            SDL_Rect src = {(slot % ATLAS_COLUMNS) * CELL_SIZE, (slot / ATLAS_COLUMNS) * CELL_SIZE, CELL_SIZE, CELL_SIZE};
+            SDL_Rect dst = {x * CELL_SIZE, y * CELL_SIZE, CELL_SIZE, CELL_SIZE};
+            batch.copy(spriteAtlas, src, dst);
+            return;
+        }
+    }
+    
+    CellType type = frame.grid(x, y);
+    if (type == ROAD) {
+        drawRoad(batch, x, y, roadMaskAt(frame, x, y));
+    } else if (type == EMPTY || type == WATER) {
+        SDL_Color base = type == EMPTY ? COLOR_EMPTY : SDL_Color{0, 0, 0, 255};
+        SDL_Rect cellRect = {x * CELL_SIZE, y * CELL_SIZE, CELL_SIZE, CELL_SIZE};
+        batch.setColor(base.r, base.g, base.b, 255);
+        batch.fillRect(cellRect);
+    } else {
+        drawBuilding(batch, x, y, frame.buildings(x, y));
+    }
+}
+
+// Draw the static cells in a range: terrain and buildings first, then roads on top
+void drawStaticCells(RenderBatch& batch, const CitySnapshot& frame, const CellRange& range) {
+    for (int y = range.y0; y < range.y1; y++) {
+        for (int x = range.x0; x < range.x1; x++) {
+            if (frame.grid(x, y) != ROAD) {
+                drawStaticCell(batch, frame, x, y);
             }
-            
-            // Draw tree if present
-            if (building.hasTree) {
-                drawTree(renderer, x, y, 1);
+        }
+    }
+    
+    for (int y = range.y0; y < range.y1; y++) {
+        for (int x = range.x0; x < range.x1; x++) {
+            if (frame.grid(x, y) == ROAD) {
+                drawStaticCell(batch, frame, x, y);
             }
-            break;
         }
-        
-        case INDUSTRIAL: {
-            // Industrial building details
-            if (building.density == 1) {
-                // Small warehouse
-                SDL_Rect doorRect;
-                doorRect.x = x * CELL_SIZE + CELL_SIZE / 3;
-                doorRect.y = y * CELL_SIZE + CELL_SIZE / 2;
-                doorRect.w = CELL_SIZE / 3;
-                doorRect.h = CELL_SIZE / 2;
-                
-                SDL_SetRenderDrawColor(renderer, 100, 100, 100, 255);
-                SDL_RenderFillRect(renderer, &doorRect);
-            } else if (building.density == 2) {
-                // Factory with smokestack
-                SDL_Rect stackRect;
-                stackRect.x = x * CELL_SIZE + CELL_SIZE / 4;
-                stackRect.y = y * CELL_SIZE;
-                stackRect.w = CELL_SIZE / 6;
-                stackRect.h = CELL_SIZE / 2;
-                
-                SDL_SetRenderDrawColor(renderer, 80, 80, 80, 255);
-                SDL_RenderFillRect(renderer, &stackRect);
-                
-                // Factory windows
-                SDL_Rect windowRect;
-                windowRect.x = x * CELL_SIZE + CELL_SIZE / 2;
-                windowRect.y = y * CELL_SIZE + CELL_SIZE / 3;
-                windowRect.w = CELL_SIZE / 3;
-                windowRect.h = CELL_SIZE / 6;
-                
-                SDL_SetRenderDrawColor(renderer, 150, 150, 120, 255);
-                SDL_RenderFillRect(renderer, &windowRect);
-            } else {
-                // Heavy industry
-                // Multiple stacks
-                for (int i = 0; i < 2; i++) {
-                    SDL_Rect stackRect;
-                    stackRect.x = x * CELL_SIZE + 2 + i * (CELL_SIZE / 2);
-                    stackRect.y = y * CELL_SIZE;
-                    stackRect.w = CELL_SIZE / 6;
-                    stackRect.h = CELL_SIZE / 2;
-                    
-                    SDL_SetRenderDrawColor(renderer, 70, 70, 70, 255);
-                    SDL_RenderFillRect(renderer, &stackRect);
-                }
-                
-                // Structure
-                SDL_Rect structureRect;
-                structureRect.x = x * CELL_SIZE + 2;
-                structureRect.y = y * CELL_SIZE + CELL_SIZE / 2;
-                structureRect.w = CELL_SIZE - 4;
-                structureRect.h = CELL_SIZE / 2;
-                
-                SDL_SetRenderDrawColor(renderer, 130, 130, 100, 255);
-                SDL_RenderFillRect(renderer, &structureRect);
+    }
+}
+
+// Cells at least partly on screen for the current camera
+CellRange visibleCells() {
+    CellRange view;
+    view.x0 = std::max(0, static_cast<int>(std::floor(camera.x / CELL_SIZE)));
+    view.y0 = std::max(0, static_cast<int>(std::floor(camera.y / CELL_SIZE)));
+    view.x1 = std::min(city->gridWidth, static_cast<int>(std::ceil((camera.x + screenWidth / camera.zoom) / CELL_SIZE)));
+    view.y1 = std::min(city->gridHeight, static_cast<int>(std::ceil((camera.y + screenHeight / camera.zoom) / CELL_SIZE)));
+    return view;
+}
+
+// Keep the camera over the world, centering the axes where the world is smaller than the screen
+void clampCamera() {
+    float minZoom = std::min(1.0f, std::min(static_cast<float>(screenWidth) / (city->gridWidth * CELL_SIZE),
+                                            static_cast<float>(screenHeight) / (city->gridHeight * CELL_SIZE)));
+    camera.zoom = std::max(minZoom, std::min(MAX_ZOOM, camera.zoom));
+    
+    float viewW = screenWidth / camera.zoom;
+    float viewH = screenHeight / camera.zoom;
+    float worldW = static_cast<float>(city->gridWidth * CELL_SIZE);
+    float worldH = static_cast<float>(city->gridHeight * CELL_SIZE);
+    camera.x = viewW >= worldW ? (worldW - viewW) / 2 : std::max(0.0f, std::min(worldW - viewW, camera.x));
+    camera.y = viewH >= worldH ? (worldH - viewH) / 2 : std::max(0.0f, std::min(worldH - viewH, camera.y));
+}
+
+// Reset to 1:1 zoom over the center of the map, where the main roads cross
+void centerCamera() {
+    camera.zoom = 1.0f;
+    camera.x = (city->gridWidth * CELL_SIZE - screenWidth) / 2.0f;
+    camera.y = (city->gridHeight * CELL_SIZE - screenHeight) / 2.0f;
+    clampCamera();
+}
+
+// Zoom by a factor, keeping the world point under the given screen position fixed
+void zoomCamera(float factor, float screenX, float screenY) {
+    float worldX = camera.x + screenX / camera.zoom;
+    float worldY = camera.y + screenY / camera.zoom;
+    camera.zoom *= factor;
+    clampCamera();
+    camera.x = worldX - screenX / camera.zoom;
+    camera.y = worldY - screenY / camera.zoom;
+    clampCamera();
+}
+
+StaticChunk* chunkAt(int column, int row) {
+    return &staticChunks[row * chunkColumns + column];
+}
+
+// Cells covered by a chunk, edge chunks may be smaller
+CellRange chunkCells(int column, int row) {
+    return {column * CHUNK_CELLS, row * CHUNK_CELLS,
+            std::min(city->gridWidth, (column + 1) * CHUNK_CELLS), std::min(city->gridHeight, (row + 1) * CHUNK_CELLS)};
+}
+
+// Create the texture of a chunk if needed, evicting the least recently drawn offscreen chunk
+bool ensureChunkTexture(SDL_Renderer* renderer, int column, int row) {
+    StaticChunk* chunk = chunkAt(column, row);
+    if (chunk->texture != nullptr) return true;
+    
+    if (chunkTextureCount >= MAX_CHUNK_TEXTURES) {
+        StaticChunk* oldest = nullptr;
+        for (auto& candidate : staticChunks) {
+            if (candidate.texture != nullptr && candidate.lastUsed != frameCounter &&
+                (oldest == nullptr || candidate.lastUsed < oldest->lastUsed)) {
+                oldest = &candidate;
             }
-            break;
         }
-        
-        case PARK: {
-            // Draw park with trees and path
-            drawTree(renderer, x, y, 2);
-            
-            // Path
-            SDL_Rect pathRect;
-            pathRect.x = x * CELL_SIZE + CELL_SIZE / 4;
-            pathRect.y = y * CELL_SIZE + CELL_SIZE / 2;
-            pathRect.w = CELL_SIZE / 2;
-            pathRect.h = CELL_SIZE / 6;
-            
-            SDL_SetRenderDrawColor(renderer, 200, 180, 140, 255);
-            SDL_RenderFillRect(renderer, &pathRect);
-            break;
+        if (oldest != nullptr) {
+            SDL_DestroyTexture(oldest->texture);
+            oldest->texture = nullptr;
+            oldest->valid = false;
+            chunkTextureCount--;
         }
-        
-        case FOREST: {
-            // Draw multiple trees for forest
-            drawTree(renderer, x, y, 3);
-            break;
+    }
+    
+    CellRange cells = chunkCells(column, row);
+    chunk->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                       (cells.x1 - cells.x0) * CELL_SIZE, (cells.y1 - cells.y0) * CELL_SIZE);
+    if (chunk->texture == nullptr) {
+        std::cerr << "Static layer chunk could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+        return false;
+    }
+    chunk->valid = false;
+    chunkTextureCount++;
+    return true;
+}
+
+// Redraw every cell of a chunk into its texture
+void redrawChunk(SDL_Renderer* renderer, const CitySnapshot& frame, int column, int row) {
+    StaticChunk* chunk = chunkAt(column, row);
+    CellRange cells = chunkCells(column, row);
+    
+    SDL_SetRenderTarget(renderer, chunk->texture);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    renderBatch.begin(renderer);
+    renderBatch.setTransform(static_cast<float>(cells.x0 * CELL_SIZE), static_cast<float>(cells.y0 * CELL_SIZE), 1.0f);
+    drawStaticCells(renderBatch, frame, cells);
+    renderBatch.flush();
+    chunk->valid = true;
+}
+
+// Flat color of a cell in the level-of-detail layer
+Uint32 lodColor(const CitySnapshot& frame, int x, int y) {
+    SDL_Color color;
+    switch (frame.grid(x, y)) {
+        case EMPTY: color = COLOR_EMPTY; break;
+        case ROAD: color = COLOR_ROAD; break;
+        case WATER: color = COLOR_WATER; break;
+        default: color = getBuildingColor(frame.buildings(x, y)); break;
+    }
+    return 0xFF000000u | (color.r << 16) | (color.g << 8) | color.b;
+}
+
+// Upload the changed rows of the level-of-detail layer, returns false if it can't be used
+bool updateLodLayer(SDL_Renderer* renderer) {
+    if (lodLayer == nullptr) {
+        lodLayer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                     city->gridWidth, city->gridHeight);
+        if (lodLayer == nullptr) {
+            std::cerr << "LOD layer texture could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+            return false;
         }
-        
-        case FARM: {
-            // Draw farm fields
-            for (int i = 0; i < 3; i++) {
-                for (int j = 0; j < 3; j++) {
-                    if ((i + j) % 2 == 0) continue; // Checkerboard pattern
-                    
-                    SDL_Rect fieldRect;
-                    fieldRect.x = x * CELL_SIZE + i * (CELL_SIZE / 3);
-                    fieldRect.y = y * CELL_SIZE + j * (CELL_SIZE / 3);
-                    fieldRect.w = CELL_SIZE / 3;
-                    fieldRect.h = CELL_SIZE / 3;
-                    
-                    // Darker green for planted fields
-                    SDL_SetRenderDrawColor(renderer, 100, 180, 60, 255);
-                    SDL_RenderFillRect(renderer, &fieldRect);
-                }
+        lodLayerValid = false;
+    }
+    
+    if (!lodLayerValid) {
+        lodDirtyTop = 0;
+        lodDirtyBottom = city->gridHeight - 1;
+        lodLayerValid = true;
+    }
+    if (lodDirtyBottom >= lodDirtyTop) {
+        SDL_Rect rows = {0, lodDirtyTop, city->gridWidth, lodDirtyBottom - lodDirtyTop + 1};
+        SDL_UpdateTexture(lodLayer, &rows, &lodPixels[lodDirtyTop * city->gridWidth], city->gridWidth * sizeof(Uint32));
+        lodDirtyTop = city->gridHeight;
+        lodDirtyBottom = -1;
+    }
+    return true;
+}
+
+// Bring the cached layers up to date. Dirty cells are redrawn right away in visible chunks;
+// offscreen chunks are only marked stale and redrawn in full once they scroll into view.
+void updateStaticLayer(SDL_Renderer* renderer, const CitySnapshot& frame, const CellRange& view, bool lod) {
+    frameCounter++;
+    if (staticChunks.empty()) {
+        chunkColumns = (city->gridWidth + CHUNK_CELLS - 1) / CHUNK_CELLS;
+        chunkRows = (city->gridHeight + CHUNK_CELLS - 1) / CHUNK_CELLS;
+        staticChunks.resize(chunkColumns * chunkRows);
+    }
+    if (lodPixels.empty()) {
+        lodPixels.resize(city->gridWidth * city->gridHeight);
+        for (int y = 0; y < city->gridHeight; y++) {
+            for (int x = 0; x < city->gridWidth; x++) {
+                lodPixels[y * city->gridWidth + x] = lodColor(frame, x, y);
+            }
+        }
+        lodLayerValid = false;
+    }
+    
+    int viewColumn0 = view.x0 / CHUNK_CELLS;
+    int viewRow0 = view.y0 / CHUNK_CELLS;
+    int viewColumn1 = (view.x1 + CHUNK_CELLS - 1) / CHUNK_CELLS;
+    int viewRow1 = (view.y1 + CHUNK_CELLS - 1) / CHUNK_CELLS;
+    
+    // Route the dirty cells to the LOD pixels and the chunks
+    pendingCells.clear();
+    for (int i = 0; i < snapshotDirtyCells.size(); i++) {
+        int cell = snapshotDirtyCells[i];
+        int x = cell % city->gridWidth;
+        int y = cell / city->gridWidth;
+        
+        lodPixels[cell] = lodColor(frame, x, y);
+        lodDirtyTop = std::min(lodDirtyTop, y);
+        lodDirtyBottom = std::max(lodDirtyBottom, y);
+        
+        int column = x / CHUNK_CELLS;
+        int row = y / CHUNK_CELLS;
+        StaticChunk* chunk = chunkAt(column, row);
+        if (!chunk->valid) continue;
+        if (!lod && column >= viewColumn0 && column < viewColumn1 && row >= viewRow0 && row < viewRow1) {
+            pendingCells.push_back(cell);
+        } else {
+            chunk->valid = false;
+        }
+    }
+    snapshotDirtyCells.clear();
+    
+    if (lod && updateLodLayer(renderer)) return;
+    if (!staticLayerAvailable) return;
+    if (!SDL_RenderTargetSupported(renderer)) {
+        staticLayerAvailable = false;
+        return;
+    }
+    
+    // Dirty cells are redrawn from atlas sprites, which never overhang into neighbors
+    if (!spriteAtlasValid) {
+        if (!bakeSpriteAtlas(renderer)) {
+            destroyStaticLayer();
+            staticLayerAvailable = false;
+            return;
+        }
+        invalidateStaticLayer();
+        pendingCells.clear();
+    }
+    
+    for (int row = viewRow0; row < viewRow1; row++) {
+        for (int column = viewColumn0; column < viewColumn1; column++) {
+            if (!ensureChunkTexture(renderer, column, row)) {
+                destroyStaticLayer();
+                staticLayerAvailable = false;
+                return;
             }
-            
-            // Small farm house
-            if (building.variant % 2 == 0) {
-                SDL_Rect houseRect;
-                houseRect.x = x * CELL_SIZE + CELL_SIZE / 6;
-                houseRect.y = y * CELL_SIZE + CELL_SIZE / 6;
-                houseRect.w = CELL_SIZE / 3;
-                houseRect.h = CELL_SIZE / 3;
-                
-                SDL_SetRenderDrawColor(renderer, 200, 150, 100, 255);
-                SDL_RenderFillRect(renderer, &houseRect);
+            StaticChunk* chunk = chunkAt(column, row);
+            chunk->lastUsed = frameCounter;
+            if (!chunk->valid) {
+                redrawChunk(renderer, frame, column, row);
             }
-            break;
         }
     }
+    
+    // Patch the visible chunks that were already up to date, one render target switch per chunk
+    std::sort(pendingCells.begin(), pendingCells.end(), [](int a, int b) {
+        int chunkA = (a / city->gridWidth / CHUNK_CELLS) * chunkColumns + (a % city->gridWidth) / CHUNK_CELLS;
+        int chunkB = (b / city->gridWidth / CHUNK_CELLS) * chunkColumns + (b % city->gridWidth) / CHUNK_CELLS;
+        return chunkA < chunkB;
+    });
+    StaticChunk* target = nullptr;
+    for (int cell : pendingCells) {
+        int x = cell % city->gridWidth;
+        int y = cell / city->gridWidth;
+        StaticChunk* chunk = chunkAt(x / CHUNK_CELLS, y / CHUNK_CELLS);
+        if (chunk != target) {
+            renderBatch.flush();
+            target = chunk;
+            SDL_SetRenderTarget(renderer, chunk->texture);
+            renderBatch.begin(renderer);
+            renderBatch.setTransform(static_cast<float>((x / CHUNK_CELLS) * CHUNK_CELLS * CELL_SIZE),
+                                     static_cast<float>((y / CHUNK_CELLS) * CHUNK_CELLS * CELL_SIZE), 1.0f);
+        }
+        drawStaticCell(renderBatch, frame, x, y);
+    }
+    renderBatch.flush();
+    renderBatch.setTransform(0.0f, 0.0f, 1.0f);
+    SDL_SetRenderTarget(renderer, nullptr);
 }
 
-// Draw water
-void drawWater(SDL_Renderer* renderer, int x, int y) {
-    SDL_Rect waterRect;
-    waterRect.x = x * CELL_SIZE;
-    waterRect.y = y * CELL_SIZE;
-    waterRect.w = CELL_SIZE;
-    waterRect.h = CELL_SIZE;
+// Mark every chunk and the LOD layer for a full redraw
+void invalidateStaticLayer() {
+    for (auto& chunk : staticChunks) {
+        chunk.valid = false;
+    }
+    lodLayerValid = false;
+}
+
+// Release the static layer and sprite atlas textures, they are recreated on the next frame
+void destroyStaticLayer() {
+    for (auto& chunk : staticChunks) {
+        if (chunk.texture != nullptr) {
+            SDL_DestroyTexture(chunk.texture);
+        }
+        chunk = StaticChunk();
+    }
+    chunkTextureCount = 0;
+    if (lodLayer != nullptr) {
+        SDL_DestroyTexture(lodLayer);
+        lodLayer = nullptr;
+    }
+    if (spriteAtlas != nullptr) {
+        SDL_DestroyTexture(spriteAtlas);
+        spriteAtlas = nullptr;
+    }
+    lodLayerValid = false;
+    spriteAtlasValid = false;
+}
+
+// Draw a snapshot of the city to the screen, alpha interpolates moving objects between simulation steps
+void drawGrid(SDL_Renderer* renderer, const CitySnapshot& frame, float alpha) {
+    ScopedPhaseTimer timer("drawGrid");
+    CellRange view = visibleCells();
+    bool lod = camera.zoom < LOD_ZOOM;
+    updateStaticLayer(renderer, frame, view, lod);
     
-    // Use animated water colors
-    SDL_Color waterColor = waterColors[waterAnimPhase];
-    SDL_SetRenderDrawColor(renderer, waterColor.r, waterColor.g, waterColor.b, 255);
-    SDL_RenderFillRect(renderer, &waterRect);
+    renderBatch.begin(renderer);
+    renderBatch.setTransform(camera.x, camera.y, camera.zoom);
     
-    // Draw wave lines
-    SDL_SetRenderDrawColor(renderer, waterColor.r + 20, waterColor.g + 20, waterColor.b + 20, 180);
-    for (int i = 0; i < 3; i++) {
-        int yOffset = (i * CELL_SIZE / 3 + waterAnimPhase * 2) % CELL_SIZE;
-        SDL_RenderDrawLine(renderer, 
-                          x * CELL_SIZE, y * CELL_SIZE + yOffset, 
-                          x * CELL_SIZE + CELL_SIZE, y * CELL_SIZE + yOffset);
+    // Zoomed far out, one texel per cell without water animation or cars
+    if (lod && lodLayer != nullptr) {
+        SDL_Rect src = {view.x0, view.y0, view.x1 - view.x0, view.y1 - view.y0};
+        SDL_Rect dst = {view.x0 * CELL_SIZE, view.y0 * CELL_SIZE, src.w * CELL_SIZE, src.h * CELL_SIZE};
+        renderBatch.copy(lodLayer, src, dst);
+        renderBatch.flush();
+        renderBatch.setTransform(0.0f, 0.0f, 1.0f);
+        return;
+    }
+    
+    // Static layer from the cached chunks, or drawn directly if render targets are unavailable
+    if (staticLayerAvailable && !staticChunks.empty() && chunkTextureCount > 0) {
+        for (int row = view.y0 / CHUNK_CELLS; row * CHUNK_CELLS < view.y1; row++) {
+            for (int column = view.x0 / CHUNK_CELLS; column * CHUNK_CELLS < view.x1; column++) {
+                StaticChunk* chunk = chunkAt(column, row);
+                if (chunk->texture == nullptr) continue;
+                CellRange cells = chunkCells(column, row);
+                SDL_Rect src = {0, 0, (cells.x1 - cells.x0) * CELL_SIZE, (cells.y1 - cells.y0) * CELL_SIZE};
+                SDL_Rect dst = {cells.x0 * CELL_SIZE, cells.y0 * CELL_SIZE, src.w, src.h};
+                renderBatch.copy(chunk->texture, src, dst);
+            }
+        }
+    } else {
+        drawStaticCells(renderBatch, frame, view);
+    }
+    
+    // Draw water from the atlas tile of the current phase, which batches into a single draw call
+    int waterSlot = SPRITE_WATER_PHASE_BASE + waterAnimPhase;
+    SDL_Rect waterSrc = {(waterSlot % ATLAS_COLUMNS) * CELL_SIZE, (waterSlot / ATLAS_COLUMNS) * CELL_SIZE, CELL_SIZE, CELL_SIZE};
+    for (const auto& [wx, wy] : frame.waterCells) {
+        if (wx >= view.x0 && wx < view.x1 && wy >= view.y0 && wy < view.y1) {
+            if (spriteAtlasValid) {
+                SDL_Rect dst = {wx * CELL_SIZE, wy * CELL_SIZE, CELL_SIZE, CELL_SIZE};
+                renderBatch.copy(spriteAtlas, waterSrc, dst);
+            } else {
+                drawWater(renderBatch, wx, wy, waterAnimPhase);
+            }
+        }
     }
+    
+    // Draw cars
+    drawCars(renderBatch, frame, view, alpha);
+    renderBatch.flush();
+    renderBatch.setTransform(0.0f, 0.0f, 1.0f);
 }
 
-// Draw road
-void drawRoad(SDL_Renderer* renderer, int x, int y) {
-    SDL_Rect roadRect;
-    roadRect.x = x * CELL_SIZE;
-    roadRect.y = y * CELL_SIZE;
-    roadRect.w = CELL_SIZE;
-    roadRect.h = CELL_SIZE;
+// Draw the perf HUD over the frame. Text is formatted into fixed buffers and drawn from the
+// runtime's glyph atlas, so the overlay adds two draw calls and no allocations.
+void drawHud(SDL_Renderer* renderer, TTF_Font* font, const CitySnapshot& frame, const HudStats& stats) {
+    const int LINE_COUNT = 4;
+    char lines[LINE_COUNT][128];
+    std::snprintf(lines[0], sizeof(lines[0]), "frame %.1f ms (%.0f fps)  draw %.2f ms  %d draw calls",
+                  stats.frameMs, stats.frameMs > 0.0 ? 1000.0 / stats.frameMs : 0.0, stats.drawMs, stats.drawCalls);
+    std::snprintf(lines[1], sizeof(lines[1]), "step %.2f ms  cars %.2f  buildings %.2f  maturing %.2f  roads %.2f",
+                  stats.step.step, stats.step.cars, stats.step.buildingSpots, stats.step.maturation, stats.step.roadGrowth);
+    std::snprintf(lines[2], sizeof(lines[2]), "%zu cars  %d roads  %d buildings",
+                  frame.carX.size(), frame.roadCount, frame.buildingCount);
+    std::snprintf(lines[3], sizeof(lines[3]), "step %d  map %dx%d  zoom %.2f",
+                  frame.step, frame.grid.getWidth(), frame.grid.getHeight(), camera.zoom);
     
-    // Road base
-    SDL_SetRenderDrawColor(renderer, COLOR_ROAD.r, COLOR_ROAD.g, COLOR_ROAD.b, 255);
-    SDL_RenderFillRect(renderer, &roadRect);
+    const char* text[LINE_COUNT] = {lines[0], lines[1], lines[2], lines[3]};
+    renderBatch.begin(renderer);
+    rt_hud_draw(renderBatch.raw(), &hudGlyphs, font, text, LINE_COUNT);
+}
+
+// Parse NAME=VALUE for --param or NAME=A,B,C for --sweep, returns false on invalid input
+bool parseParamOption(const std::string& text, bool sweep, Options& options) {
+    size_t equals = text.find('=');
+    const CityParamField* field = nullptr;
+    for (const CityParamField& candidate : CITY_PARAM_FIELDS) {
+        if (equals != std::string::npos && text.compare(0, equals, candidate.name) == 0 &&
+            std::strlen(candidate.name) == equals) {
+            field = &candidate;
+        }
+    }
+    if (field == nullptr) {
+        std::cerr << "Unknown parameter in " << text << ", expected one of:";
+        for (const CityParamField& candidate : CITY_PARAM_FIELDS) {
+            std::cerr << " " << candidate.name;
+        }
+        std::cerr << std::endl;
+        return false;
+    }
     
-    // Road markings
-    SDL_SetRenderDrawColor(renderer, 220, 220, 220, 255);
-    
-    // Check if the road is horizontal or vertical
-    bool northRoad = isValidCell(x, y-1) && grid[x][y-1] == ROAD;
-    bool southRoad = isValidCell(x, y+1) && grid[x][y+1] == ROAD;
-    bool eastRoad = isValidCell(x+1, y) && grid[x+1][y] == ROAD;
-    bool westRoad = isValidCell(x-1, y) && grid[x-1][y] == ROAD;
-    
-    bool vertical = northRoad || southRoad;
-    bool horizontal = eastRoad || westRoad;
-    
-    if (vertical && !horizontal) {
-        // Vertical road - draw center line
-        SDL_RenderDrawLine(renderer, 
-                          x * CELL_SIZE + CELL_SIZE / 2, y * CELL_SIZE, 
-                          x * CELL_SIZE + CELL_SIZE / 2, y * CELL_SIZE + CELL_SIZE);
-    } else if (horizontal && !vertical) {
-        // Horizontal road - draw center line
-        SDL_RenderDrawLine(renderer, 
-                          x * CELL_SIZE, y * CELL_SIZE + CELL_SIZE / 2, 
-                          x * CELL_SIZE + CELL_SIZE, y * CELL_SIZE + CELL_SIZE / 2);
-    } else if (vertical && horizontal) {
-        // Intersection - draw crossing lines
-        SDL_RenderDrawLine(renderer, 
-                          x * CELL_SIZE + CELL_SIZE / 2, y * CELL_SIZE, 
-                          x * CELL_SIZE + CELL_SIZE / 2, y * CELL_SIZE + CELL_SIZE);
-        SDL_RenderDrawLine(renderer, 
-                          x * CELL_SIZE, y * CELL_SIZE + CELL_SIZE / 2, 
-                          x * CELL_SIZE + CELL_SIZE, y * CELL_SIZE + CELL_SIZE / 2);
+    std::vector<int> values;
+    std::stringstream list(text.substr(equals + 1));
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        char* end = nullptr;
+        long value = std::strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || value < field->minimum || value > INT_MAX) {
+            std::cerr << field->name << " expects integers of at least " << field->minimum
+                      << ", got " << item << std::endl;
+            return false;
+        }
+        values.push_back(static_cast<int>(value));
+    }
+    if (values.empty() || (!sweep && values.size() != 1)) {
+        std::cerr << (sweep ? "--sweep expects NAME=A,B,C" : "--param expects NAME=VALUE") << std::endl;
+        return false;
+    }
+    
+    if (sweep) {
+        options.sweeps.push_back({field, values});
     } else {
-        // End of road or corner - draw a small square in the middle
-        SDL_Rect centerRect;
-        centerRect.x = x * CELL_SIZE + CELL_SIZE / 3;
-        centerRect.y = y * CELL_SIZE + CELL_SIZE / 3;
-        centerRect.w = CELL_SIZE / 3;
-        centerRect.h = CELL_SIZE / 3;
-        SDL_RenderFillRect(renderer, &centerRect);
+        options.params.*(field->field) = values[0];
     }
+    return true;
 }
 
-// Draw tree
-void drawTree(SDL_Renderer* renderer, int x, int y, int size) {
-    SDL_Rect trunkRect;
-    if (size == 1) {
-        // Single small tree
-        trunkRect.x = x * CELL_SIZE + CELL_SIZE * 3 / 4;
-        trunkRect.y = y * CELL_SIZE + CELL_SIZE * 2 / 3;
-        trunkRect.w = CELL_SIZE / 8;
-        trunkRect.h = CELL_SIZE / 4;
-        
-        SDL_SetRenderDrawColor(renderer, 120, 80, 40, 255);
-        SDL_RenderFillRect(renderer, &trunkRect);
-        
-        // Tree top
-        SDL_SetRenderDrawColor(renderer, 40, 160, 40, 255);
-        SDL_Rect leafRect;
-        leafRect.x = x * CELL_SIZE + CELL_SIZE * 2 / 3;
-        leafRect.y = y * CELL_SIZE + CELL_SIZE / 2;
-        leafRect.w = CELL_SIZE / 4;
-        leafRect.h = CELL_SIZE / 4;
-        SDL_RenderFillRect(renderer, &leafRect);
-    } else if (size == 2) {
-        // Medium park tree
-        trunkRect.x = x * CELL_SIZE + CELL_SIZE / 2 - CELL_SIZE / 10;
-        trunkRect.y = y * CELL_SIZE + CELL_SIZE / 2;
-        trunkRect.w = CELL_SIZE / 5;
-        trunkRect.h = CELL_SIZE / 3;
+// Parse command line arguments, returns false on invalid input
+bool parseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
         
-        SDL_SetRenderDrawColor(renderer, 120, 80, 40, 255);
-        SDL_RenderFillRect(renderer, &trunkRect);
-        
-        // Tree top
-        SDL_SetRenderDrawColor(renderer, 40, 180, 40, 255);
-        int radius = CELL_SIZE / 3;
-        for (int dx = -radius; dx <= radius; dx++) {
-            for (int dy = -radius; dy <= radius; dy++) {
-                if (dx*dx + dy*dy <= radius*radius) {
-                    SDL_RenderDrawPoint(renderer, 
-                                      x * CELL_SIZE + CELL_SIZE / 2 + dx, 
-                                      y * CELL_SIZE + CELL_SIZE / 3 + dy);
+        if (arg == "--headless") {
+            options.headless = true;
+        } else if (arg == "--draw") {
+            options.headlessDraw = true;
+        } else if (arg == "--steps" && hasValue) {
+            options.steps = std::atoi(argv[++i]);
+        } else if (arg == "--seed" && hasValue) {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+            options.hasSeed = true;
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--load" && hasValue) {
+            options.loadPath = argv[++i];
+        } else if (arg == "--save" && hasValue) {
+            options.savePath = argv[++i];
+        } else if (arg == "--save-interval" && hasValue) {
+            options.saveInterval = std::atoi(argv[++i]);
+        } else if (arg == "--trace" && hasValue) {
+            options.tracePath = argv[++i];
+        } else if (arg == "--record" && hasValue) {
+            options.recordDir = argv[++i];
+        } else if (arg == "--record-pipe" && hasValue) {
+            options.recordPipe = argv[++i];
+        } else if (arg == "--record-every" && hasValue) {
+            options.recordEvery = std::atoi(argv[++i]);
+        } else if (arg == "--hud") {
+            options.showHud = true;
+        } else if (arg == "--batch" && hasValue) {
+            options.batchRuns = std::atoi(argv[++i]);
+        } else if ((arg == "--param" || arg == "--sweep") && hasValue) {
+            if (!parseParamOption(argv[++i], arg == "--sweep", options)) {
+                return false;
+            }
+        } else if (arg == "--display" && hasValue) {
+            std::string name = argv[++i];
+            for (int d = 0; d < DISPLAY_PRESET_COUNT; d++) {
+                if (name == DISPLAY_PRESETS[d].name) {
+                    options.display = d;
                 }
             }
+            if (options.display < 0) {
+                std::cerr << "--display expects handheld, hd or desktop" << std::endl;
+                return false;
+            }
+        } else if (arg == "--map" && hasValue) {
+            if (std::sscanf(argv[++i], "%dx%d", &options.mapWidth, &options.mapHeight) != 2) {
+                std::cerr << "--map expects WIDTHxHEIGHT, for example 1024x1024" << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            std::cerr << "Usage: city_sim [--seed N] [--display NAME] [--map WxH] [--threads N] [--load FILE]"
+                      << " [--save FILE [--save-interval N]] [--trace FILE] [--hud]"
+                      << " [--record DIR | --record-pipe COMMAND] [--record-every N]"
+                      << " [--headless [--steps N] [--draw]] [--param NAME=VALUE]"
+                      << " [--batch N [--steps N] [--sweep NAME=A,B,C]]" << std::endl;
+            return false;
         }
-    } else {
-        // Forest - multiple trees
-        // First tree
-        trunkRect.x = x * CELL_SIZE + CELL_SIZE / 3;
-        trunkRect.y = y * CELL_SIZE + CELL_SIZE / 2;
-        trunkRect.w = CELL_SIZE / 8;
-        trunkRect.h = CELL_SIZE / 3;
-        
-        SDL_SetRenderDrawColor(renderer, 100, 70, 30, 255);
-        SDL_RenderFillRect(renderer, &trunkRect);
-        
-        SDL_SetRenderDrawColor(renderer, 30, 130, 30, 255);
-        SDL_Rect leaf1Rect;
-        leaf1Rect.x = x * CELL_SIZE + CELL_SIZE / 4;
-        leaf1Rect.y = y * CELL_SIZE + CELL_SIZE / 4;
-        leaf1Rect.w = CELL_SIZE / 4;
-        leaf1Rect.h = CELL_SIZE / 4;
-        SDL_RenderFillRect(renderer, &leaf1Rect);
-        
-        // Second tree
-        trunkRect.x = x * CELL_SIZE + CELL_SIZE * 2 / 3;
-        trunkRect.y = y * CELL_SIZE + CELL_SIZE * 2 / 3;
-        trunkRect.w = CELL_SIZE / 8;
-        trunkRect.h = CELL_SIZE / 4;
-        
-        SDL_SetRenderDrawColor(renderer, 110, 75, 35, 255);
-        SDL_RenderFillRect(renderer, &trunkRect);
-        
-        SDL_SetRenderDrawColor(renderer, 35, 140, 35, 255);
-        SDL_Rect leaf2Rect;
-        leaf2Rect.x = x * CELL_SIZE + CELL_SIZE * 3 / 5;
-        leaf2Rect.y = y * CELL_SIZE + CELL_SIZE / 2;
-        leaf2Rect.w = CELL_SIZE / 4;
-        leaf2Rect.h = CELL_SIZE / 4;
-        SDL_RenderFillRect(renderer, &leaf2Rect);
     }
+    
+    if (options.steps < 0) {
+        std::cerr << "--steps must not be negative" << std::endl;
+        return false;
+    }
+    if (options.saveInterval < 0) {
+        std::cerr << "--save-interval must not be negative" << std::endl;
+        return false;
+    }
+    if (options.batchRuns < 0) {
+        std::cerr << "--batch must not be negative" << std::endl;
+        return false;
+    }
+    if (!options.sweeps.empty() && options.batchRuns == 0) {
+        std::cerr << "--sweep needs --batch" << std::endl;
+        return false;
+    }
+    if (options.batchRuns > 0 && (!options.loadPath.empty() || !options.savePath.empty() ||
+                                  !options.recordDir.empty() || !options.recordPipe.empty())) {
+        std::cerr << "--batch runs new cities only, without loading, saving or recording" << std::endl;
+        return false;
+    }
+    if (options.recordEvery < 1) {
+        std::cerr << "--record-every must be at least 1" << std::endl;
+        return false;
+    }
+    if (!options.recordDir.empty() && !options.recordPipe.empty()) {
+        std::cerr << "--record and --record-pipe are exclusive" << std::endl;
+        return false;
+    }
+    if (options.threads < 0 || options.threads > MAX_THREADS) {
+        std::cerr << "--threads must be between 0 and " << MAX_THREADS << std::endl;
+        return false;
+    }
+    bool defaultMap = options.mapWidth == 0 && options.mapHeight == 0;
+    if (!defaultMap && (options.mapWidth < MIN_GRID_SIZE || options.mapHeight < MIN_GRID_SIZE ||
+                        options.mapWidth > MAX_GRID_SIZE || options.mapHeight > MAX_GRID_SIZE)) {
+        std::cerr << "--map sides must be between " << MIN_GRID_SIZE << " and " << MAX_GRID_SIZE << std::endl;
+        return false;
+    }
+    return true;
 }
 
-// Perform one simulation step
-void simulationStep() {
-    // Update water animation
-    updateWaterAnimation();
+// Largest preset that fits on the desktop, the smallest one if none does
+int pickDisplayPreset() {
+    int width = 0;
+    int height = 0;
+    if (!rt_display_size(&width, &height)) {
+        return HD_DISPLAY;
+    }
+    int display = 0;
+    for (int d = 0; d < DISPLAY_PRESET_COUNT; d++) {
+        if (DISPLAY_PRESETS[d].width <= width && DISPLAY_PRESETS[d].height <= height) {
+            display = d;
+        }
+    }
+    return display;
+}
+
+// Start from the save file if one was given, otherwise generate a new city from the seed
+bool createCity(const Options& options, Uint64 seed) {
+    if (!options.loadPath.empty()) {
+        return loadCity(options.loadPath);
+    }
+    seedRandom(seed);
+    initializeGrid();
+    return true;
+}
+
+// Run the simulation without a window and print per-phase timings as JSON
+int runHeadless(const Options& options) {
+    SDL_Surface* surface = nullptr;
+    SDL_Renderer* renderer = nullptr;
+    bool recording = !options.recordDir.empty() || !options.recordPipe.empty();
+    if (options.headlessDraw || recording) {
+        surface = SDL_CreateRGBSurfaceWithFormat(0, screenWidth, screenHeight, 32, SDL_PIXELFORMAT_RGBA8888);
+        if (surface != nullptr) {
+            renderer = SDL_CreateSoftwareRenderer(surface);
+        }
+        if (renderer == nullptr) {
+            std::cerr << "Offscreen renderer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+            if (surface != nullptr) {
+                SDL_FreeSurface(surface);
+            }
+            return 1;
+        }
+    }
+    if (recording && !frameRecorder.start(renderer, options.recordDir, options.recordPipe)) {
+        SDL_DestroyRenderer(renderer);
+        SDL_FreeSurface(surface);
+        return 1;
+    }
     
-    // Move cars
-    updateCars();
+    auto loadStart = std::chrono::steady_clock::now();
+    if (!createCity(options, options.seed)) {
+        if (renderer != nullptr) {
+            SDL_DestroyRenderer(renderer);
+            SDL_FreeSurface(surface);
+        }
+        return 1;
+    }
+    double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    resetSnapshots();
+    centerCamera();
+    phaseTimingEnabled = true;
     
-    // Only grow the city every few steps to slow down development
-    if (currentStep % 3 == 0) {
-        growCity();
+    // Single threaded, each step is published and drawn right away
+    Uint64 allocationsBefore = allocationCount.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < options.steps; i++) {
+        simulationStep();
+        if (renderer != nullptr) {
+            ScopedPhaseTimer timer("frame", &city->phaseTimings.draw);
+            publishSnapshot();
+            acquireSnapshot();
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
+            drawGrid(renderer, snapshots.frontBuffer(), 1.0f);
+            // Nothing waits on a headless run, so it blocks rather than drop a frame
+            if (recording && city->currentStep % options.recordEvery == 0) {
+                frameRecorder.capture(renderer, true);
+            }
+            SDL_RenderPresent(renderer);
+        }
+        checkAutoSave();
+    }
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    Uint64 allocations = allocationCount.load() - allocationsBefore;
+    frameRecorder.stop();
+    
+    std::cout << std::fixed << std::setprecision(3)
+              << "{\"seed\": " << options.seed
+              << ", \"steps\": " << options.steps
+              << ", \"grid\": [" << city->gridWidth << ", " << city->gridHeight << "]"
+              << ", \"specialized_grid\": " << (isBuiltInGridShape(city->gridWidth, city->gridHeight) ? "true" : "false")
+              << ", \"threads\": " << workers.size()
+              << ", \"total_ms\": " << totalMs
+              << ", \"steps_per_sec\": " << (totalMs > 0.0 ? options.steps * 1000.0 / totalMs : 0.0)
+              << ", \"phases_ms\": {"
+              << "\"building_spots\": " << city->phaseTimings.buildingSpots
+              << ", \"maturation\": " << city->phaseTimings.maturation
+              << ", \"road_growth\": " << city->phaseTimings.roadGrowth
+              << ", \"cars\": " << city->phaseTimings.cars;
+    if (renderer != nullptr) {
+        std::cout << ", \"draw\": " << city->phaseTimings.draw;
     }
+    std::cout << "}";
+    if (!options.loadPath.empty()) {
+        std::cout << ", \"load_ms\": " << loadMs;
+    }
+    if (recording) {
+        std::cout << ", \"recorded_frames\": " << frameRecorder.framesWritten();
+    }
+    std::cout << ", \"allocations\": " << allocations
+              << ", \"roads\": " << city->roads.size()
+              << ", \"cars\": " << city->cars.size()
+              << ", \"building_spots\": " << city->buildingSpots.size()
+              << "}" << std::endl;
     
-    currentStep++;
+    if (!savePath.empty()) {
+        saveWriter.wait();
+        saveCity(savePath);
+        saveWriter.stop();
+    }
+    if (renderer != nullptr) {
+        destroyStaticLayer();
+        SDL_DestroyRenderer(renderer);
+        SDL_FreeSurface(surface);
+    }
+    if (traceRecorder.enabled()) {
+        traceRecorder.write(options.tracePath);
+    }
+    return 0;
 }
 
-// Draw the grid to the screen
-void drawGrid(SDL_Renderer* renderer) {
-    // Draw base terrain
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            SDL_Rect cellRect;
-            cellRect.x = x * CELL_SIZE;
-            cellRect.y = y * CELL_SIZE;
-            cellRect.w = CELL_SIZE;
-            cellRect.h = CELL_SIZE;
-            
-            // Draw base color for empty cells
-            if (grid[x][y] == EMPTY) {
-                SDL_SetRenderDrawColor(renderer, COLOR_EMPTY.r, COLOR_EMPTY.g, COLOR_EMPTY.b, 255);
-                SDL_RenderFillRect(renderer, &cellRect);
+// One city of a batch: its seed and the parameters it grows with
+struct BatchRun {
+    Uint64 seed;
+    CityParams params;
+};
+
+// Every combination of the swept values, the first sweep varying slowest, times the batch's seeds
+std::vector<BatchRun> planBatch(const Options& options) {
+    std::vector<CityParams> combinations = {options.params};
+    for (const ParamSweep& sweep : options.sweeps) {
+        std::vector<CityParams> expanded;
+        for (const CityParams& base : combinations) {
+            for (int value : sweep.values) {
+                CityParams params = base;
+                params.*(sweep.field->field) = value;
+                expanded.push_back(params);
             }
         }
+        combinations.swap(expanded);
+    }
+    
+    std::vector<BatchRun> runs;
+    for (const CityParams& params : combinations) {
+        for (int r = 0; r < options.batchRuns; r++) {
+            runs.push_back({options.seed + r, params});
+        }
+    }
+    return runs;
+}
+
+// Summary statistics of the calling thread's city as one line of JSON
+std::string batchSummary(size_t index, const BatchRun& run, int steps, double totalMs) {
+    int cellCounts[CELL_TYPE_COUNT] = {};
+    for (int y = 0; y < city->gridHeight; y++) {
+        for (int x = 0; x < city->gridWidth; x++) {
+            cellCounts[city->grid(x, y)]++;
+        }
     }
     
-    // Draw water
-    for (const auto& [wx, wy] : waterCells) {
-        drawWater(renderer, wx, wy);
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(3)
+         << "{\"run\": " << index
+         << ", \"seed\": " << run.seed
+         << ", \"params\": {";
+    for (const CityParamField& field : CITY_PARAM_FIELDS) {
+        line << (&field == CITY_PARAM_FIELDS ? "" : ", ") << "\"" << field.name << "\": " << run.params.*(field.field);
     }
+    line << "}, \"steps\": " << steps
+         << ", \"total_ms\": " << totalMs
+         << ", \"roads\": " << city->roads.size()
+         << ", \"cars\": " << city->cars.size()
+         << ", \"building_spots\": " << city->buildingSpots.size()
+         << ", \"homes\": " << city->homes.size()
+         << ", \"workplaces\": " << city->workplaces.size()
+         << ", \"cells\": {";
+    for (int type = 0; type < CELL_TYPE_COUNT; type++) {
+        line << (type == 0 ? "" : ", ") << "\"" << CELL_TYPE_NAMES[type] << "\": " << cellCounts[type];
+    }
+    line << "}}";
+    return line.str();
+}
+
+// Simulate many independent cities, one per thread at a time, and print one JSON line of
+// summary statistics per run as it finishes. Runs only depend on their seed and parameters,
+// so the lines can be matched up by "run" whatever order they arrive in.
+int runBatch(const Options& options, int threadCount) {
+    std::vector<BatchRun> runs = planBatch(options);
+    std::atomic<size_t> nextRun{0};
+    std::mutex outputMutex;
     
-    // Draw buildings
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            if (grid[x][y] != EMPTY && grid[x][y] != ROAD && grid[x][y] != WATER) {
-                drawBuilding(renderer, x, y, buildings[x][y]);
+    auto simulateRuns = [&]() {
+        for (size_t i = nextRun++; i < runs.size(); i = nextRun++) {
+            // Tile work runs inline, the batch's threads already keep every core busy
+            City runCity;
+            runCity.params = runs[i].params;
+            runCity.gridWidth = mainCity.gridWidth;
+            runCity.gridHeight = mainCity.gridHeight;
+            city = &runCity;
+            
+            auto start = std::chrono::steady_clock::now();
+            seedRandom(runs[i].seed);
+            initializeGrid();
+            for (int step = 0; step < options.steps; step++) {
+                simulationStep();
             }
+            double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            
+            std::string line = batchSummary(i, runs[i], options.steps, totalMs);
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cout << line << std::endl;
         }
-    }
+        city = nullptr;
+    };
     
-    // Draw roads
-    for (const auto& [rx, ry] : roads) {
-        drawRoad(renderer, rx, ry);
+    // The main thread simulates too
+    int helperCount = std::min(threadCount, static_cast<int>(runs.size())) - 1;
+    std::vector<std::thread> helpers;
+    for (int t = 0; t < helperCount; t++) {
+        helpers.emplace_back([&]() {
+            traceRecorder.nameThread("batch");
+            simulateRuns();
+        });
+    }
+    simulateRuns();
+    for (std::thread& helper : helpers) {
+        helper.join();
     }
+    city = &mainCity;
     
-    // Draw cars
-    drawCars(renderer);
+    if (traceRecorder.enabled()) {
+        traceRecorder.write(options.tracePath);
+    }
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
-    // Initialize SDL
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
         return 1;
     }
+    city = &mainCity;
+    mainCity.params = options.params;
+    initializeWaterAnimation();
     
-    // Initialize SDL_ttf
-    if (TTF_Init() < 0) {
-        std::cerr << "SDL_ttf could not initialize! TTF_Error: " << TTF_GetError() << std::endl;
-        return 1;
+    // Headless runs never open a window, they use the hd preset unless told otherwise
+    int display = options.display;
+    if (display < 0) {
+        display = options.headless ? HD_DISPLAY : pickDisplayPreset();
+    }
+    screenWidth = DISPLAY_PRESETS[display].width;
+    screenHeight = DISPLAY_PRESETS[display].height;
+    if (options.mapWidth == 0) {
+        city->gridWidth = screenWidth / CELL_SIZE;
+        city->gridHeight = screenHeight / CELL_SIZE;
+    } else {
+        city->gridWidth = options.mapWidth;
+        city->gridHeight = options.mapHeight;
     }
     
-    // Create window
-    SDL_Window* window = SDL_CreateWindow("City Simulation", 
-                                         SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 
-                                         SCREEN_WIDTH, SCREEN_HEIGHT, 
-                                         SDL_WINDOW_SHOWN);
-    if (window == NULL) {
-        std::cerr << "Window could not be created! SDL_Error: " << SDL_GetError() << std::endl;
-        return 1;
+    // Before any thread starts, so every one of them sees it
+    if (!options.tracePath.empty()) {
+        traceRecorder.enable();
+        traceRecorder.nameThread("main");
     }
     
-    // Create renderer
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (renderer == NULL) {
-        std::cerr << "Renderer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
-        return 1;
+    int threadCount = options.threads;
+    if (threadCount == 0) {
+        threadCount = std::max(1, std::min(MAX_THREADS, static_cast<int>(std::thread::hardware_concurrency())));
+    }
+    // Batch cities step on their own threads, without the shared pool
+    if (options.batchRuns > 0) {
+        return runBatch(options, threadCount);
     }
+    workers.start(threadCount);
+    mainCity.pool = &workers;
     
-    // Load font
-    TTF_Font* font = TTF_OpenFont("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf", 16);
-    if (font == NULL) {
-        std::cerr << "Failed to load font! TTF_Error: " << TTF_GetError() << std::endl;
-        // Try a fallback font
-        font = TTF_OpenFont("/usr/share/fonts/truetype/freefont/FreeSans.ttf", 16);
-        if (font == NULL) {
-            std::cerr << "Failed to load fallback font! TTF_Error: " << TTF_GetError() << std::endl;
-        }
+    savePath = options.savePath;
+    saveInterval = options.saveInterval;
+    if (!savePath.empty()) {
+        saveWriter.start();
+    }
+    
+    // Headless runs never touch the video subsystem or fonts
+    if (options.headless) {
+        return runHeadless(options);
+    }
+    // Print the seed so an interesting run can be reproduced with --seed
+    Uint64 seed = options.seed;
+    if (!options.hasSeed) {
+        std::random_device rd;
+        seed = (static_cast<Uint64>(rd()) << 32) | rd();
+    }
+    if (options.loadPath.empty()) {
+        std::cout << "Seed: " << seed << std::endl;
+    }
+    
+    // Window, renderer and controller come from the shared runtime
+    RtApp app;
+    if (!rt_app_init(&app, "City Simulation", screenWidth, screenHeight)) {
+        return 1;
+    }
+    SDL_Renderer* renderer = app.renderer;
+    if ((!options.recordDir.empty() || !options.recordPipe.empty()) &&
+        !frameRecorder.start(renderer, options.recordDir, options.recordPipe)) {
+        rt_app_quit(&app);
+        return 1;
     }
     
+    // Only the HUD draws text, the font is opened the first time it is shown
+    RtFont hudFont;
+    rt_font_init(&hudFont, HUD_FONT_SIZE, "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+                 "/usr/share/fonts/truetype/freefont/FreeSans.ttf");
+    
     // Initialize simulation
-    initializeGrid();
+    if (!createCity(options, seed)) {
+        return 1;
+    }
+    if (!options.loadPath.empty()) {
+        std::cout << "Loaded " << options.loadPath << " at step " << city->currentStep << std::endl;
+    }
+    resetSnapshots();
+    centerCamera();
+    phaseTimingEnabled = true;
+    
+    // The simulation runs on its own thread and publishes a snapshot after every step
+    snapshotEventType = SDL_RegisterEvents(1);
+    std::thread simulationThread(runSimulationThread);
     
     // Main loop flag
     bool quit = false;
@@ -1269,51 +5001,245 @@ int main(int argc, char* argv[]) {
     // Event handler
     SDL_Event e;
     
-    // Main loop
-    Uint32 lastTime = SDL_GetTicks();
+    // Main loop: renders the newest snapshot at display rate, never waiting for a step to finish
+    Uint32 previousTime = SDL_GetTicks();
+    bool needsRedraw = true;
+    bool cameraMoving = false;
     
-    while (!quit && currentStep < MAX_SIMULATION_STEPS) {
+    bool hudVisible = options.showHud;
+    HudStats hudStats;
+    auto previousPresent = std::chrono::steady_clock::now();
+    
+    while (!quit && !simulationFinished) {
+        // With nothing moving on screen, sleep until the next snapshot, water frame or event
+        const CitySnapshot& shown = snapshots.frontBuffer();
+        bool carsMoving = !shown.carX.empty() && SDL_GetTicks() - shown.publishedAt < SIMULATION_DELAY;
+        bool idle = !needsRedraw && !cameraMoving && !carsMoving;
+        bool haveEvent;
+        if (idle) {
+            Uint32 timeout = SIMULATION_DELAY;
+            if (!shown.waterCells.empty()) {
+                Uint32 sinceWater = SDL_GetTicks() - lastWaterAnimTime;
+                timeout = std::min(timeout, sinceWater <= WATER_ANIM_DELAY ? WATER_ANIM_DELAY + 1 - sinceWater : 0);
+            }
+            haveEvent = rt_app_wait_event(&app, &e, static_cast<int>(timeout));
+        } else {
+            haveEvent = rt_app_wait_event(&app, &e, 0);
+        }
+        
         // Handle events
-        while (SDL_PollEvent(&e) != 0) {
+        while (haveEvent) {
             if (e.type == SDL_QUIT) {
                 quit = true;
             }
+            else if (rt_app_handle_event(&app, &e)) {
+                // Controller plugged in or removed
+            }
             else if (e.type == SDL_KEYDOWN) {
-                if (e.key.keysym.sym == SDLK_ESCAPE) {
-                    quit = true;
+                switch (e.key.keysym.sym) {
+                    case SDLK_ESCAPE:
+                        quit = true;
+                        break;
+                    case SDLK_EQUALS:
+                    case SDLK_PLUS:
+                    case SDLK_KP_PLUS:
+                        zoomCamera(ZOOM_STEP, screenWidth / 2.0f, screenHeight / 2.0f);
+                        needsRedraw = true;
+                        break;
+                    case SDLK_MINUS:
+                    case SDLK_KP_MINUS:
+                        zoomCamera(1.0f / ZOOM_STEP, screenWidth / 2.0f, screenHeight / 2.0f);
+                        needsRedraw = true;
+                        break;
+                    case SDLK_HOME:
+                        centerCamera();
+                        needsRedraw = true;
+                        break;
+                    case SDLK_F1:
+                        hudVisible = !hudVisible;
+                        needsRedraw = true;
+                        break;
+                    case SDLK_F5:
+                        // Saved by the simulation thread between steps
+                        if (!savePath.empty()) {
+                            {
+                                std::lock_guard<std::mutex> lock(simulationMutex);
+                                saveRequested = true;
+                            }
+                            simulationWake.notify_all();
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            else if (e.type == SDL_MOUSEWHEEL && e.wheel.y != 0) {
+                // Zoom around the mouse pointer
+                int mouseX, mouseY;
+                SDL_GetMouseState(&mouseX, &mouseY);
+                zoomCamera(e.wheel.y > 0 ? ZOOM_STEP : 1.0f / ZOOM_STEP, static_cast<float>(mouseX), static_cast<float>(mouseY));
+                needsRedraw = true;
+            }
+            else if (e.type == SDL_MOUSEMOTION && (e.motion.state & SDL_BUTTON_LMASK)) {
+                // Drag to pan
+                camera.x -= e.motion.xrel / camera.zoom;
+                camera.y -= e.motion.yrel / camera.zoom;
+                clampCamera();
+                needsRedraw = true;
+            }
+            else if (e.type == SDL_CONTROLLERBUTTONDOWN) {
+                if (e.cbutton.button == SDL_CONTROLLER_BUTTON_RIGHTSHOULDER) {
+                    zoomCamera(ZOOM_STEP, screenWidth / 2.0f, screenHeight / 2.0f);
+                } else if (e.cbutton.button == SDL_CONTROLLER_BUTTON_LEFTSHOULDER) {
+                    zoomCamera(1.0f / ZOOM_STEP, screenWidth / 2.0f, screenHeight / 2.0f);
+                } else if (e.cbutton.button == SDL_CONTROLLER_BUTTON_BACK) {
+                    centerCamera();
+                } else if (e.cbutton.button == SDL_CONTROLLER_BUTTON_Y) {
+                    hudVisible = !hudVisible;
                 }
+                needsRedraw = true;
+            }
+            else if (e.type == SDL_WINDOWEVENT) {
+                // Exposed, resized or restored windows need a fresh frame
+                needsRedraw = true;
+            }
+            else if (e.type == SDL_RENDER_TARGETS_RESET) {
+                // Target contents were lost, rebake the atlas and redraw the static layer
+                spriteAtlasValid = false;
+                invalidateStaticLayer();
+                needsRedraw = true;
             }
+            else if (e.type == SDL_RENDER_DEVICE_RESET) {
+                // All textures were lost and must be recreated
+                destroyStaticLayer();
+                rt_glyphs_destroy(&hudGlyphs);
+                needsRedraw = true;
+            }
+            haveEvent = rt_app_wait_event(&app, &e, 0);
         }
         
-        // Perform simulation step at specific intervals
-        Uint32 currentTime = SDL_GetTicks();
-        if (currentTime - lastTime >= SIMULATION_DELAY) {
-            simulationStep();
-            lastTime = currentTime;
+        Uint32 frameStart = SDL_GetTicks();
+        Uint32 frameDelta = frameStart - previousTime;
+        previousTime = frameStart;
+        
+        // Switch to the newest snapshot, if the simulation published one
+        bool newSnapshot = acquireSnapshot();
+        if (newSnapshot) {
+            needsRedraw = true;
+            const PhaseTimings& t = snapshots.frontBuffer().timings;
+            hudStats.step.step += (t.step - hudStats.step.step) * HUD_SMOOTHING;
+            hudStats.step.cars += (t.cars - hudStats.step.cars) * HUD_SMOOTHING;
+            hudStats.step.buildingSpots += (t.buildingSpots - hudStats.step.buildingSpots) * HUD_SMOOTHING;
+            hudStats.step.maturation += (t.maturation - hudStats.step.maturation) * HUD_SMOOTHING;
+            hudStats.step.roadGrowth += (t.roadGrowth - hudStats.step.roadGrowth) * HUD_SMOOTHING;
+        }
+        const CitySnapshot& frame = snapshots.frontBuffer();
+        
+        if (updateWaterAnimation() && !frame.waterCells.empty()) {
+            needsRedraw = true;
+        }
+        
+        // Continuous panning from held keys, the controller's left stick and its d-pad
+        float panX = 0.0f;
+        float panY = 0.0f;
+        const Uint8* keys = SDL_GetKeyboardState(nullptr);
+        SDL_GameController* controller = app.controller;
+        if (keys[SDL_SCANCODE_LEFT] || keys[SDL_SCANCODE_A]) panX -= 1.0f;
+        if (keys[SDL_SCANCODE_RIGHT] || keys[SDL_SCANCODE_D]) panX += 1.0f;
+        if (keys[SDL_SCANCODE_UP] || keys[SDL_SCANCODE_W]) panY -= 1.0f;
+        if (keys[SDL_SCANCODE_DOWN] || keys[SDL_SCANCODE_S]) panY += 1.0f;
+        if (controller != nullptr) {
+            int stickX = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_LEFTX);
+            int stickY = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_LEFTY);
+            if (std::abs(stickX) > CONTROLLER_DEAD_ZONE) panX += stickX / 32768.0f;
+            if (std::abs(stickY) > CONTROLLER_DEAD_ZONE) panY += stickY / 32768.0f;
+            if (SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_LEFT)) panX -= 1.0f;
+            if (SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_RIGHT)) panX += 1.0f;
+            if (SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_UP)) panY -= 1.0f;
+            if (SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_DOWN)) panY += 1.0f;
+        }
+        cameraMoving = panX != 0.0f || panY != 0.0f;
+        if (cameraMoving) {
+            // Long idle waits are clamped so the first moving frame doesn't jump
+            float distance = PAN_SPEED * std::min(frameDelta, 100u) / 1000.0f / camera.zoom;
+            camera.x += panX * distance;
+            camera.y += panY * distance;
+            clampCamera();
+            needsRedraw = true;
         }
         
+        // Cars move every frame while interpolating towards the snapshot positions
+        Uint32 sincePublished = frameStart - frame.publishedAt;
+        if (!frame.carX.empty() && sincePublished < SIMULATION_DELAY) {
+            needsRedraw = true;
+        }
+        
+        if (!needsRedraw) continue;
+        
         // Clear screen
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
         
         // Draw city grid
-        drawGrid(renderer);
+        float alpha = static_cast<float>(std::min(sincePublished, SIMULATION_DELAY)) / SIMULATION_DELAY;
+        auto drawStart = std::chrono::steady_clock::now();
+        renderBatch.resetDrawCallCount();
+        drawGrid(renderer, frame, alpha);
+        double drawMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - drawStart).count();
+        hudStats.drawMs += (drawMs - hudStats.drawMs) * HUD_SMOOTHING;
+        hudStats.drawCalls = renderBatch.drawCallCount();
+        
+        // The first frame of a step is recorded, before the HUD goes on top
+        if (newSnapshot && frameRecorder.active() && frame.step % options.recordEvery == 0) {
+            frameRecorder.capture(renderer, false);
+        }
+        if (hudVisible) {
+            drawHud(renderer, rt_font_get(&hudFont), frame, hudStats);
+        }
         
-        // Update screen
-        SDL_RenderPresent(renderer);
+        // Update screen, paced to the display when vsync is unavailable
+        rt_app_present(&app);
+        needsRedraw = false;
         
-        // Cap to ~60 FPS for smooth animation
-        SDL_Delay(16);
+        // Idle waits between frames would swamp the average, only continuous frames count
+        auto presented = std::chrono::steady_clock::now();
+        double frameMs = std::chrono::duration<double, std::milli>(presented - previousPresent).count();
+        previousPresent = presented;
+        if (frameMs < 4 * SIMULATION_DELAY) {
+            hudStats.frameMs += (frameMs - hudStats.frameMs) * HUD_SMOOTHING;
+        }
     }
     
-    // Clean up
-    if (font != NULL) {
-        TTF_CloseFont(font);
+    // Stop the simulation thread, it finishes the step in progress first
+    {
+        std::lock_guard<std::mutex> lock(simulationMutex);
+        simulationStopping = true;
     }
-    TTF_Quit();
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+    simulationWake.notify_all();
+    simulationThread.join();
+    
+    if (frameRecorder.active()) {
+        frameRecorder.stop();
+        std::cout << "Recorded " << frameRecorder.framesWritten() << " frames, "
+                  << frameRecorder.framesDropped() << " dropped" << std::endl;
+    }
+    
+    // Final save, after any periodic save still in flight
+    if (!savePath.empty()) {
+        saveWriter.wait();
+        saveCity(savePath);
+        saveWriter.stop();
+    }
+    
+    if (traceRecorder.enabled()) {
+        traceRecorder.write(options.tracePath);
+    }
+    
+    // Clean up
+    destroyStaticLayer();
+    rt_glyphs_destroy(&hudGlyphs);
+    rt_font_close(&hudFont);
+    rt_app_quit(&app);
     
     return 0;
 }
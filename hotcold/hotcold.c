@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include "runtime.h"
+
 #define WINDOW_WIDTH 800
 #define WINDOW_HEIGHT 600
 #define MAX_ATTEMPTS 8
@@ -24,7 +26,6 @@ typedef struct {
     GameScreen current_screen;
     char messages[MAX_MESSAGES][256];
     SDL_Color message_colors[MAX_MESSAGES];
-    SDL_GameController *controller;
 } GameState;
 
 void init_game(GameState *game) {
@@ -92,26 +93,22 @@ void make_guess(GameState *game) {
     }
 }
 
-void render_text(SDL_Renderer *renderer, TTF_Font *font, const char *text, 
+// Draw text horizontally centered in the window
+void render_text(SDL_Renderer *renderer, RtTextCache *cache, TTF_Font *font, const char *text, 
                 int y, SDL_Color color) {
-    if (text[0] == '\0') return;
-    
-    SDL_Surface *surface = TTF_RenderText_Blended(font, text, color);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+    const RtText *entry = rt_text_get(cache, renderer, font, text, color);
+    if (!entry) return;
     
     SDL_Rect dest = {
-        .x = (WINDOW_WIDTH - surface->w) / 2,
+        .x = (WINDOW_WIDTH - entry->w) / 2,
         .y = y,
-        .w = surface->w,
-        .h = surface->h
+        .w = entry->w,
+        .h = entry->h
     };
-    
-    SDL_RenderCopy(renderer, texture, NULL, &dest);
-    SDL_FreeSurface(surface);
-    SDL_DestroyTexture(texture);
+    SDL_RenderCopy(renderer, entry->texture, NULL, &dest);
 }
 
-void render_title(SDL_Renderer *renderer, TTF_Font *font_big) {
+void render_title(SDL_Renderer *renderer, RtTextCache *cache, TTF_Font *font_big) {
     SDL_Color colors[] = {
         {255, 0, 0, 255},    // Hot
         {0, 150, 255, 255}   // Cold
@@ -121,52 +118,27 @@ void render_title(SDL_Renderer *renderer, TTF_Font *font_big) {
     int x_pos = WINDOW_WIDTH / 2 - 120;
     
     for (int i = 0; i < 2; i++) {
-        SDL_Surface *surface = TTF_RenderText_Blended(font_big, words[i], colors[i]);
-        SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-        
-        SDL_Rect dest = {
-            .x = x_pos + (i * 130),
-            .y = 30,
-            .w = surface->w,
-            .h = surface->h
-        };
-        
-        SDL_RenderCopy(renderer, texture, NULL, &dest);
-        SDL_FreeSurface(surface);
-        SDL_DestroyTexture(texture);
+        rt_text_draw(cache, renderer, font_big, words[i], x_pos + (i * 130), 30, colors[i]);
     }
 }
 
-void render_attempts(SDL_Renderer *renderer, TTF_Font *font, int attempts) {
+void render_attempts(SDL_Renderer *renderer, RtTextCache *cache, TTF_Font *font, int attempts) {
     char attempt_text[32];
     snprintf(attempt_text, sizeof(attempt_text), "Attempts: %d/%d", attempts, MAX_ATTEMPTS);
     
     SDL_Color color = {200, 200, 200, 255};
-    SDL_Surface *surface = TTF_RenderText_Blended(font, attempt_text, color);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    
-    SDL_Rect dest = {
-        .x = 20,
-        .y = 20,
-        .w = surface->w,
-        .h = surface->h
-    };
-    
-    SDL_RenderCopy(renderer, texture, NULL, &dest);
-    SDL_FreeSurface(surface);
-    SDL_DestroyTexture(texture);
+    rt_text_draw(cache, renderer, font, attempt_text, 20, 20, color);
 }
 
-void render_game_screen(SDL_Renderer *renderer, TTF_Font *font, TTF_Font *font_big, GameState *game) {
-    render_title(renderer, font_big);
-    render_attempts(renderer, font, game->attempts);
+void render_game_screen(SDL_Renderer *renderer, RtTextCache *cache, TTF_Font *font, TTF_Font *font_big,
+                        GameState *game) {
+    render_title(renderer, cache, font_big);
+    render_attempts(renderer, cache, font, game->attempts);
     
     // Render current guess
     char guess_text[32];
     snprintf(guess_text, sizeof(guess_text), "%d", game->current_guess);
     SDL_Color guess_color = {255, 255, 255, 255};
-    SDL_Surface *surface = TTF_RenderText_Blended(font_big, guess_text, guess_color);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
     
     // Draw guess background
     SDL_SetRenderDrawColor(renderer, 40, 40, 50, 255);
@@ -177,157 +149,86 @@ void render_game_screen(SDL_Renderer *renderer, TTF_Font *font, TTF_Font *font_b
         .h = 80
     };
     SDL_RenderFillRect(renderer, &guess_bg);
-    
-    SDL_Rect guess_dest = {
-        .x = (WINDOW_WIDTH - surface->w) / 2,
-        .y = 230,
-        .w = surface->w,
-        .h = surface->h
-    };
-    SDL_RenderCopy(renderer, texture, NULL, &guess_dest);
-    SDL_FreeSurface(surface);
-    SDL_DestroyTexture(texture);
+    render_text(renderer, cache, font_big, guess_text, 230, guess_color);
     
     // Render temperature for confirmed guesses
     if (game->last_guess != -1 && !game->game_over) {
         char temp_text[32];
         SDL_Color temp_color;
         get_temperature(game, temp_text, &temp_color);
-        SDL_Surface *temp_surface = TTF_RenderText_Blended(font, temp_text, temp_color);
-        SDL_Texture *temp_texture = SDL_CreateTextureFromSurface(renderer, temp_surface);
-        
-        SDL_Rect temp_dest = {
-            .x = (WINDOW_WIDTH - temp_surface->w) / 2,
-            .y = 350,
-            .w = temp_surface->w,
-            .h = temp_surface->h
-        };
-        SDL_RenderCopy(renderer, temp_texture, NULL, &temp_dest);
-        SDL_FreeSurface(temp_surface);
-        SDL_DestroyTexture(temp_texture);
+        render_text(renderer, cache, font, temp_text, 350, temp_color);
     }
     
     // Render game messages
-    if (game->messages[0][0] != '\0') {
-        SDL_Surface *msg_surface = TTF_RenderText_Blended(font, game->messages[0], 
-                                                        game->message_colors[0]);
-        SDL_Texture *msg_texture = SDL_CreateTextureFromSurface(renderer, msg_surface);
-        
-        SDL_Rect msg_dest = {
-            .x = (WINDOW_WIDTH - msg_surface->w) / 2,
-            .y = 450,
-            .w = msg_surface->w,
-            .h = msg_surface->h
-        };
-        SDL_RenderCopy(renderer, msg_texture, NULL, &msg_dest);
-        SDL_FreeSurface(msg_surface);
-        SDL_DestroyTexture(msg_texture);
-    }
+    render_text(renderer, cache, font, game->messages[0], 450, game->message_colors[0]);
 }
 
-void render_welcome_screen(SDL_Renderer *renderer, TTF_Font *font, TTF_Font *font_big, GameState *game) {
-    render_title(renderer, font_big);
+void render_welcome_screen(SDL_Renderer *renderer, RtTextCache *cache, TTF_Font *font, TTF_Font *font_big,
+                           GameState *game) {
+    render_title(renderer, cache, font_big);
     
     for (int i = 0; i < MAX_MESSAGES; i++) {
-        SDL_Surface *surface = TTF_RenderText_Blended(font, game->messages[i], 
-                                                    game->message_colors[i]);
-        SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-        
-        SDL_Rect dest = {
-            .x = (WINDOW_WIDTH - surface->w) / 2,
-            .y = 200 + (i * 60),
-            .w = surface->w,
-            .h = surface->h
-        };
-        
-        SDL_RenderCopy(renderer, texture, NULL, &dest);
-        SDL_FreeSurface(surface);
-        SDL_DestroyTexture(texture);
+        render_text(renderer, cache, font, game->messages[i], 200 + (i * 60), game->message_colors[i]);
     }
 }
 
 int main(int argc, char *argv[]) {
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER) < 0) {
-        printf("SDL initialization failed: %s\n", SDL_GetError());
-        return 1;
-    }
-    
-    // Initialize game controller
-    SDL_GameController *controller = NULL;
-    for (int i = 0; i < SDL_NumJoysticks(); i++) {
-        if (SDL_IsGameController(i)) {
-            controller = SDL_GameControllerOpen(i);
-            if (controller) {
-                printf("Found game controller: %s\n", 
-                       SDL_GameControllerName(controller));
-                break;
-            }
-        }
-    }
-    
-    if (TTF_Init() < 0) {
-        printf("TTF initialization failed: %s\n", TTF_GetError());
-        if (controller) SDL_GameControllerClose(controller);
-        SDL_Quit();
+    RtApp app;
+    if (!rt_app_init(&app, "Hot/Cold Game", WINDOW_WIDTH, WINDOW_HEIGHT)) {
         return 1;
     }
-
-    SDL_Window *window = SDL_CreateWindow(
-        "Hot/Cold Game",
-        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        WINDOW_WIDTH, WINDOW_HEIGHT,
-        SDL_WINDOW_SHOWN
-    );
+    SDL_Renderer *renderer = app.renderer;
     
-    if (!window) {
-        printf("Window creation failed: %s\n", SDL_GetError());
-        if (controller) SDL_GameControllerClose(controller);
-        TTF_Quit();
-        SDL_Quit();
-        return 1;
-    }
-
-    SDL_Renderer *renderer = SDL_CreateRenderer(
-        window, -1,
-        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC
-    );
-    
-    if (!renderer) {
-        printf("Renderer creation failed: %s\n", SDL_GetError());
-        SDL_DestroyWindow(window);
-        if (controller) SDL_GameControllerClose(controller);
-        TTF_Quit();
-        SDL_Quit();
-        return 1;
-    }
-
-    TTF_Font *font = TTF_OpenFont("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf", 24);
-    TTF_Font *font_big = TTF_OpenFont("/usr/share/fonts/truetype/dejavu/DejaVuSans-Bold.ttf", 48);
+    // Both fonts are on screen from the first frame, so there is nothing to defer
+    RtFont font_regular, font_bold;
+    rt_font_init(&font_regular, 24, "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+                 "/usr/share/fonts/truetype/freefont/FreeSans.ttf");
+    rt_font_init(&font_bold, 48, "/usr/share/fonts/truetype/dejavu/DejaVuSans-Bold.ttf",
+                 "/usr/share/fonts/truetype/freefont/FreeSansBold.ttf");
+    TTF_Font *font = rt_font_get(&font_regular);
+    TTF_Font *font_big = rt_font_get(&font_bold);
     
     if (!font || !font_big) {
-        printf("Font loading failed: %s\n", TTF_GetError());
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        if (controller) SDL_GameControllerClose(controller);
-        TTF_Quit();
-        SDL_Quit();
+        printf("Font loading failed\n");
+        rt_font_close(&font_regular);
+        rt_font_close(&font_bold);
+        rt_app_quit(&app);
         return 1;
     }
     
+    RtTextCache text_cache;
+    rt_text_cache_init(&text_cache);
+    
     srand(time(NULL));
     GameState game;
-    game.controller = controller;
     init_game(&game);
     
     bool running = true;
     SDL_Event event;
-    Uint32 last_controller_check = 0;
-    const int CONTROLLER_CHECK_INTERVAL = 1000;
+    
+    // Frames are only drawn when something on screen changed, the rest of the time the
+    // loop sleeps until the next event. Controllers arrive as hotplug events.
+    bool needs_redraw = true;
     
     while (running) {
-        while (SDL_PollEvent(&event)) {
+        bool have_event = rt_app_wait_event(&app, &event, needs_redraw ? 0 : -1);
+        
+        while (have_event) {
+            int previous_guess = game.current_guess;
+            GameScreen previous_screen = game.current_screen;
+            int previous_attempts = game.attempts;
+            
             if (event.type == SDL_QUIT) {
                 running = false;
+            } else if (rt_app_handle_event(&app, &event)) {
+                // Controller plugged in or removed
+            } else if (event.type == SDL_RENDER_DEVICE_RESET) {
+                // The cached textures went with the device
+                rt_text_cache_clear(&text_cache);
+                needs_redraw = true;
+            } else if (event.type == SDL_WINDOWEVENT || event.type == SDL_RENDER_TARGETS_RESET) {
+                // Exposed, resized or restored windows need a fresh frame
+                needs_redraw = true;
             } else if (game.current_screen == WELCOME_SCREEN) {
                 if (event.type == SDL_KEYDOWN || 
                     (event.type == SDL_CONTROLLERBUTTONDOWN)) {
@@ -368,63 +269,37 @@ int main(int argc, char *argv[]) {
                        (event.type == SDL_CONTROLLERBUTTONDOWN && 
                         event.cbutton.button == SDL_CONTROLLER_BUTTON_A)) {
                 init_game(&game);
-            } else if (event.type == SDL_CONTROLLERDEVICEADDED) {
-                if (!game.controller) {
-                    game.controller = SDL_GameControllerOpen(event.cdevice.which);
-                    if (game.controller) {
-                        printf("Controller connected: %s\n", 
-                               SDL_GameControllerName(game.controller));
-                    }
-                }
-            } else if (event.type == SDL_CONTROLLERDEVICEREMOVED) {
-                if (game.controller && 
-                    event.cdevice.which == SDL_JoystickInstanceID(
-                        SDL_GameControllerGetJoystick(game.controller))) {
-                    SDL_GameControllerClose(game.controller);
-                    game.controller = NULL;
-                    printf("Controller disconnected\n");
-                }
             }
-        }
-
-        // Check for new controllers periodically
-        Uint32 current_time = SDL_GetTicks();
-        if (!game.controller && (current_time - last_controller_check > CONTROLLER_CHECK_INTERVAL)) {
-            for (int i = 0; i < SDL_NumJoysticks(); i++) {
-                if (SDL_IsGameController(i)) {
-                    game.controller = SDL_GameControllerOpen(i);
-                    if (game.controller) {
-                        printf("Found game controller: %s\n", 
-                               SDL_GameControllerName(game.controller));
-                        break;
-                    }
-                }
+            
+            // Guesses move the number, make_guess counts an attempt and rewrites the message
+            if (game.current_guess != previous_guess || game.current_screen != previous_screen ||
+                game.attempts != previous_attempts) {
+                needs_redraw = true;
             }
-            last_controller_check = current_time;
+            have_event = rt_app_wait_event(&app, &event, 0);
         }
         
+        if (!needs_redraw) continue;
+        
         // Render game
         SDL_SetRenderDrawColor(renderer, 20, 20, 30, 255);
         SDL_RenderClear(renderer);
         
         if (game.current_screen == WELCOME_SCREEN) {
-            render_welcome_screen(renderer, font, font_big, &game);
+            render_welcome_screen(renderer, &text_cache, font, font_big, &game);
         } else {
-            render_game_screen(renderer, font, font_big, &game);
+            render_game_screen(renderer, &text_cache, font, font_big, &game);
         }
         
-        SDL_RenderPresent(renderer);
+        rt_app_present(&app);
+        needs_redraw = false;
     }
     
-    if (game.controller) {
-        SDL_GameControllerClose(game.controller);
-    }
-    TTF_CloseFont(font_big);
-    TTF_CloseFont(font);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
-    TTF_Quit();
-    SDL_Quit();
+    rt_app_print_frame_stats(&app);
+    rt_text_cache_clear(&text_cache);
+    rt_font_close(&font_bold);
+    rt_font_close(&font_regular);
+    rt_app_quit(&app);
     
     return 0;
-}
\ No newline at end of file
+}
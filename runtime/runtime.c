@@ -0,0 +1,496 @@
+#include "runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define GLYPH_ATLAS_WIDTH 512
+#define HUD_MARGIN 8
+
+// Prefer the GLES2 renderer, the handhelds' GPU drivers only accelerate GLES well.
+// An SDL_RENDER_DRIVER set by the user still wins.
+static int pick_render_driver(void) {
+    if (SDL_GetHint(SDL_HINT_RENDER_DRIVER)) return -1;
+    
+    for (int i = 0; i < SDL_GetNumRenderDrivers(); i++) {
+        SDL_RendererInfo info;
+        if (SDL_GetRenderDriverInfo(i, &info) == 0 && strcmp(info.name, "opengles2") == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void open_first_controller(RtApp *app) {
+    for (int i = 0; i < SDL_NumJoysticks() && !app->controller; i++) {
+        if (SDL_IsGameController(i)) {
+            app->controller = SDL_GameControllerOpen(i);
+            if (app->controller) {
+                printf("Found game controller: %s\n", SDL_GameControllerName(app->controller));
+            }
+        }
+    }
+}
+
+bool rt_display_size(int *width, int *height) {
+    if (!SDL_WasInit(SDL_INIT_VIDEO) && SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) {
+        fprintf(stderr, "SDL video initialization failed: %s\n", SDL_GetError());
+        return false;
+    }
+    SDL_DisplayMode mode;
+    if (SDL_GetDesktopDisplayMode(0, &mode) != 0 || mode.w <= 0 || mode.h <= 0) {
+        return false;
+    }
+    *width = mode.w;
+    *height = mode.h;
+    return true;
+}
+
+bool rt_app_init(RtApp *app, const char *title, int width, int height) {
+    memset(app, 0, sizeof(*app));
+    
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER) < 0) {
+        fprintf(stderr, "SDL initialization failed: %s\n", SDL_GetError());
+        return false;
+    }
+    
+    app->window = SDL_CreateWindow(title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                   width, height, SDL_WINDOW_SHOWN);
+    if (!app->window) {
+        fprintf(stderr, "Window creation failed: %s\n", SDL_GetError());
+        SDL_Quit();
+        return false;
+    }
+    
+    // Picking a driver explicitly turns SDL's own command batching off unless asked for
+    int driver = pick_render_driver();
+    SDL_SetHint(SDL_HINT_RENDER_BATCHING, "1");
+    app->renderer = SDL_CreateRenderer(app->window, driver, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (!app->renderer && driver != -1) {
+        app->renderer = SDL_CreateRenderer(app->window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    }
+    if (!app->renderer) {
+        app->renderer = SDL_CreateRenderer(app->window, -1, SDL_RENDERER_SOFTWARE);
+    }
+    if (!app->renderer) {
+        fprintf(stderr, "Renderer creation failed: %s\n", SDL_GetError());
+        SDL_DestroyWindow(app->window);
+        SDL_Quit();
+        return false;
+    }
+    
+    SDL_RendererInfo info;
+    app->vsync = SDL_GetRendererInfo(app->renderer, &info) == 0 && (info.flags & SDL_RENDERER_PRESENTVSYNC) != 0;
+    
+    SDL_DisplayMode mode;
+    app->refresh_rate = RT_DEFAULT_REFRESH_RATE;
+    if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(app->window), &mode) == 0 && mode.refresh_rate > 0) {
+        app->refresh_rate = mode.refresh_rate;
+    }
+    
+    open_first_controller(app);
+    app->start_ticks = SDL_GetTicks();
+    return true;
+}
+
+void rt_app_quit(RtApp *app) {
+    if (app->controller) {
+        SDL_GameControllerClose(app->controller);
+    }
+    SDL_DestroyRenderer(app->renderer);
+    SDL_DestroyWindow(app->window);
+    if (TTF_WasInit()) {
+        TTF_Quit();
+    }
+    SDL_Quit();
+    memset(app, 0, sizeof(*app));
+}
+
+bool rt_app_handle_event(RtApp *app, const SDL_Event *event) {
+    if (event->type == SDL_CONTROLLERDEVICEADDED) {
+        if (!app->controller) {
+            app->controller = SDL_GameControllerOpen(event->cdevice.which);
+            if (app->controller) {
+                printf("Controller connected: %s\n", SDL_GameControllerName(app->controller));
+            }
+        }
+        return true;
+    }
+    if (event->type == SDL_CONTROLLERDEVICEREMOVED) {
+        if (app->controller &&
+            event->cdevice.which == SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(app->controller))) {
+            SDL_GameControllerClose(app->controller);
+            app->controller = NULL;
+            printf("Controller disconnected\n");
+            
+            // Fall back to another one that is still plugged in
+            open_first_controller(app);
+        }
+        return true;
+    }
+    return false;
+}
+
+bool rt_app_wait_event(RtApp *app, SDL_Event *event, int timeout) {
+    (void)app;
+    if (timeout == 0) return SDL_PollEvent(event) != 0;
+    if (timeout < 0) return SDL_WaitEvent(event) != 0;
+    return SDL_WaitEventTimeout(event, timeout) != 0;
+}
+
+void rt_app_present(RtApp *app) {
+    // Without vsync hold each frame until one refresh interval after the previous one.
+    // Frames after an idle wait are late already and go out right away.
+    if (!app->vsync) {
+        Uint64 frequency = SDL_GetPerformanceFrequency();
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now < app->next_frame) {
+            SDL_Delay((Uint32)((app->next_frame - now) * 1000 / frequency));
+            now = app->next_frame;
+        }
+        app->next_frame = now + frequency / app->refresh_rate;
+    }
+    SDL_RenderPresent(app->renderer);
+    app->frames_presented++;
+}
+
+void rt_app_print_frame_stats(const RtApp *app) {
+    Uint32 elapsed = SDL_GetTicks() - app->start_ticks;
+    Uint32 display_frames = (Uint32)((Uint64)elapsed * app->refresh_rate / 1000);
+    Uint32 skipped = display_frames > app->frames_presented ? display_frames - app->frames_presented : 0;
+    printf("Drew %u frames in %.1f s, skipped %u of %u at %d Hz\n",
+           app->frames_presented, elapsed / 1000.0, skipped, display_frames, app->refresh_rate);
+}
+
+void rt_font_init(RtFont *font, int size, const char *path, const char *fallback_path) {
+    memset(font, 0, sizeof(*font));
+    font->path = path;
+    font->fallback_path = fallback_path;
+    font->size = size;
+}
+
+TTF_Font *rt_font_get(RtFont *font) {
+    if (font->font || font->failed) return font->font;
+    
+    font->failed = true;
+    if (!TTF_WasInit() && TTF_Init() < 0) {
+        fprintf(stderr, "TTF initialization failed: %s\n", TTF_GetError());
+        return NULL;
+    }
+    font->font = TTF_OpenFont(font->path, font->size);
+    if (!font->font) {
+        fprintf(stderr, "Failed to load font %s: %s\n", font->path, TTF_GetError());
+        if (font->fallback_path) {
+            font->font = TTF_OpenFont(font->fallback_path, font->size);
+            if (!font->font) {
+                fprintf(stderr, "Failed to load fallback font %s: %s\n", font->fallback_path, TTF_GetError());
+            }
+        }
+    }
+    font->failed = !font->font;
+    return font->font;
+}
+
+void rt_font_close(RtFont *font) {
+    if (font->font) {
+        TTF_CloseFont(font->font);
+        font->font = NULL;
+    }
+}
+
+void rt_text_cache_init(RtTextCache *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+void rt_text_cache_clear(RtTextCache *cache) {
+    for (int i = 0; i < RT_TEXT_CACHE_SIZE; i++) {
+        if (cache->entries[i].texture) {
+            SDL_DestroyTexture(cache->entries[i].texture);
+        }
+    }
+    rt_text_cache_init(cache);
+}
+
+static bool same_color(SDL_Color a, SDL_Color b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// A miss renders into the least recently used slot
+const RtText *rt_text_get(RtTextCache *cache, SDL_Renderer *renderer, TTF_Font *font,
+                          const char *text, SDL_Color color) {
+    if (!font || text[0] == '\0' || strlen(text) >= RT_MAX_TEXT_LENGTH) return NULL;
+    cache->clock++;
+    
+    RtText *slot = &cache->entries[0];
+    for (int i = 0; i < RT_TEXT_CACHE_SIZE; i++) {
+        RtText *entry = &cache->entries[i];
+        if (entry->texture && entry->font == font && same_color(entry->color, color) &&
+            strcmp(entry->text, text) == 0) {
+            entry->last_used = cache->clock;
+            return entry;
+        }
+        if (!entry->texture || (slot->texture && entry->last_used < slot->last_used)) {
+            slot = entry;
+        }
+    }
+    
+    SDL_Surface *surface = TTF_RenderText_Blended(font, text, color);
+    if (!surface) {
+        fprintf(stderr, "Text rendering failed: %s\n", TTF_GetError());
+        return NULL;
+    }
+    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+    int w = surface->w;
+    int h = surface->h;
+    SDL_FreeSurface(surface);
+    if (!texture) {
+        fprintf(stderr, "Text texture creation failed: %s\n", SDL_GetError());
+        return NULL;
+    }
+    
+    if (slot->texture) {
+        SDL_DestroyTexture(slot->texture);
+    }
+    slot->font = font;
+    slot->color = color;
+    snprintf(slot->text, sizeof(slot->text), "%s", text);
+    slot->texture = texture;
+    slot->w = w;
+    slot->h = h;
+    slot->last_used = cache->clock;
+    return slot;
+}
+
+void rt_text_draw(RtTextCache *cache, SDL_Renderer *renderer, TTF_Font *font, const char *text,
+                  int x, int y, SDL_Color color) {
+    const RtText *entry = rt_text_get(cache, renderer, font, text, color);
+    if (!entry) return;
+    
+    SDL_Rect dest = {x, y, entry->w, entry->h};
+    SDL_RenderCopy(renderer, entry->texture, NULL, &dest);
+}
+
+void rt_batch_begin(RtBatch *batch, SDL_Renderer *renderer) {
+    rt_batch_flush(batch);
+    batch->renderer = renderer;
+}
+
+// Grow an array to hold at least count more items, false if out of memory
+static bool reserve(void **items, int *capacity, int used, int count, size_t item_size) {
+    if (used + count <= *capacity) return true;
+    int grown = *capacity > 0 ? *capacity * 2 : 1024;
+    while (grown < used + count) grown *= 2;
+    void *resized = realloc(*items, (size_t)grown * item_size);
+    if (!resized) return false;
+    *items = resized;
+    *capacity = grown;
+    return true;
+}
+
+#if RT_BATCH_GEOMETRY
+static void add_quad(RtBatch *batch, float x0, float y0, float x1, float y1, SDL_Color color,
+                     float u0, float v0, float u1, float v1) {
+    if (!reserve((void **)&batch->vertices, &batch->vertex_capacity, batch->vertex_count, 4, sizeof(SDL_Vertex)) ||
+        !reserve((void **)&batch->indices, &batch->index_capacity, batch->index_count, 6, sizeof(int))) {
+        return;
+    }
+    
+    int base = batch->vertex_count;
+    SDL_Vertex *v = &batch->vertices[base];
+    v[0] = (SDL_Vertex){{x0, y0}, color, {u0, v0}};
+    v[1] = (SDL_Vertex){{x1, y0}, color, {u1, v0}};
+    v[2] = (SDL_Vertex){{x1, y1}, color, {u1, v1}};
+    v[3] = (SDL_Vertex){{x0, y1}, color, {u0, v1}};
+    batch->vertex_count += 4;
+    
+    static const int quad[] = {0, 1, 2, 0, 2, 3};
+    for (int i = 0; i < 6; i++) {
+        batch->indices[batch->index_count++] = base + quad[i];
+    }
+}
+#else
+// Round both edges so neighboring rects still share an edge after scaling
+static SDL_Rect round_rect(float x0, float y0, float x1, float y1) {
+    int left = (int)lroundf(x0);
+    int top = (int)lroundf(y0);
+    SDL_Rect rect = {left, top, (int)lroundf(x1) - left, (int)lroundf(y1) - top};
+    return rect;
+}
+#endif
+
+void rt_batch_fill(RtBatch *batch, float x0, float y0, float x1, float y1, SDL_Color color) {
+#if RT_BATCH_GEOMETRY
+    if (batch->texture) rt_batch_flush(batch);
+    add_quad(batch, x0, y0, x1, y1, color, 0.0f, 0.0f, 0.0f, 0.0f);
+#else
+    SDL_Rect rect = round_rect(x0, y0, x1, y1);
+    if (rect.w <= 0 || rect.h <= 0) return;
+    if (batch->rect_count > 0 && !same_color(batch->rect_color, color)) rt_batch_flush(batch);
+    if (!reserve((void **)&batch->rects, &batch->rect_capacity, batch->rect_count, 1, sizeof(SDL_Rect))) return;
+    batch->rect_color = color;
+    batch->rects[batch->rect_count++] = rect;
+#endif
+}
+
+void rt_batch_copy(RtBatch *batch, SDL_Texture *texture, const SDL_Rect *src,
+                   float x0, float y0, float x1, float y1) {
+#if RT_BATCH_GEOMETRY
+    if (texture != batch->texture) {
+        rt_batch_flush(batch);
+        batch->texture = texture;
+        int w = 1, h = 1;
+        SDL_QueryTexture(texture, NULL, NULL, &w, &h);
+        batch->texel_w = 1.0f / w;
+        batch->texel_h = 1.0f / h;
+    }
+    SDL_Color white = {255, 255, 255, 255};
+    add_quad(batch, x0, y0, x1, y1, white, src->x * batch->texel_w, src->y * batch->texel_h,
+             (src->x + src->w) * batch->texel_w, (src->y + src->h) * batch->texel_h);
+#else
+    SDL_Rect screen = round_rect(x0, y0, x1, y1);
+    if (screen.w <= 0 || screen.h <= 0) return;
+    rt_batch_flush(batch);
+    SDL_RenderCopy(batch->renderer, texture, src, &screen);
+    batch->draw_calls++;
+#endif
+}
+
+void rt_batch_line(RtBatch *batch, int x1, int y1, int x2, int y2, SDL_Color color) {
+    rt_batch_flush(batch);
+    SDL_SetRenderDrawColor(batch->renderer, color.r, color.g, color.b, color.a);
+    SDL_RenderDrawLine(batch->renderer, x1, y1, x2, y2);
+    batch->draw_calls++;
+}
+
+void rt_batch_flush(RtBatch *batch) {
+#if RT_BATCH_GEOMETRY
+    if (batch->vertex_count > 0) {
+        SDL_RenderGeometry(batch->renderer, batch->texture, batch->vertices, batch->vertex_count,
+                           batch->indices, batch->index_count);
+        batch->draw_calls++;
+        batch->vertex_count = 0;
+        batch->index_count = 0;
+    }
+    batch->texture = NULL;
+#else
+    if (batch->rect_count > 0) {
+        SDL_Color c = batch->rect_color;
+        SDL_SetRenderDrawColor(batch->renderer, c.r, c.g, c.b, c.a);
+        SDL_RenderFillRects(batch->renderer, batch->rects, batch->rect_count);
+        batch->draw_calls++;
+        batch->rect_count = 0;
+    }
+#endif
+}
+
+void rt_batch_free(RtBatch *batch) {
+#if RT_BATCH_GEOMETRY
+    free(batch->vertices);
+    free(batch->indices);
+#else
+    free(batch->rects);
+#endif
+    memset(batch, 0, sizeof(*batch));
+}
+
+bool rt_glyphs_build(RtGlyphAtlas *atlas, SDL_Renderer *renderer, TTF_Font *font) {
+    SDL_Surface *glyph_surfaces[RT_GLYPH_COUNT];
+    SDL_Color white = {255, 255, 255, 255};
+    int line_height = TTF_FontHeight(font);
+    int pen_x = 0;
+    int pen_y = 0;
+    for (int i = 0; i < RT_GLYPH_COUNT; i++) {
+        Uint16 ch = (Uint16)(RT_FIRST_GLYPH + i);
+        int min_x, max_x, min_y, max_y, advance = 0;
+        TTF_GlyphMetrics(font, ch, &min_x, &max_x, &min_y, &max_y, &advance);
+        atlas->advance[i] = advance;
+        
+        glyph_surfaces[i] = TTF_RenderGlyph_Blended(font, ch, white);
+        int w = glyph_surfaces[i] ? glyph_surfaces[i]->w : 0;
+        if (pen_x + w > GLYPH_ATLAS_WIDTH) {
+            pen_x = 0;
+            pen_y += line_height;
+        }
+        atlas->glyphs[i] = (SDL_Rect){pen_x, pen_y, w, line_height};
+        pen_x += w;
+    }
+    
+    SDL_Surface *sheet = SDL_CreateRGBSurfaceWithFormat(0, GLYPH_ATLAS_WIDTH, pen_y + line_height, 32,
+                                                        SDL_PIXELFORMAT_RGBA32);
+    for (int i = 0; i < RT_GLYPH_COUNT; i++) {
+        if (!glyph_surfaces[i]) continue;
+        if (sheet) {
+            // Copy coverage into the alpha channel instead of blending it onto the empty sheet
+            SDL_SetSurfaceBlendMode(glyph_surfaces[i], SDL_BLENDMODE_NONE);
+            SDL_BlitSurface(glyph_surfaces[i], NULL, sheet, &atlas->glyphs[i]);
+        }
+        SDL_FreeSurface(glyph_surfaces[i]);
+    }
+    if (!sheet) {
+        fprintf(stderr, "Glyph atlas creation failed: %s\n", SDL_GetError());
+        return false;
+    }
+    
+    atlas->texture = SDL_CreateTextureFromSurface(renderer, sheet);
+    SDL_FreeSurface(sheet);
+    if (!atlas->texture) {
+        fprintf(stderr, "Glyph atlas texture creation failed: %s\n", SDL_GetError());
+        return false;
+    }
+    SDL_SetTextureBlendMode(atlas->texture, SDL_BLENDMODE_BLEND);
+    atlas->line_height = line_height;
+    return true;
+}
+
+void rt_glyphs_destroy(RtGlyphAtlas *atlas) {
+    if (atlas->texture) {
+        SDL_DestroyTexture(atlas->texture);
+        atlas->texture = NULL;
+    }
+}
+
+int rt_glyphs_width(const RtGlyphAtlas *atlas, const char *text) {
+    int width = 0;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (*c >= RT_FIRST_GLYPH && *c <= RT_LAST_GLYPH) width += atlas->advance[*c - RT_FIRST_GLYPH];
+    }
+    return width;
+}
+
+int rt_glyphs_draw(const RtGlyphAtlas *atlas, RtBatch *batch, int x, int y, const char *text) {
+    int pen_x = x;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (*c < RT_FIRST_GLYPH || *c > RT_LAST_GLYPH) continue;
+        int i = *c - RT_FIRST_GLYPH;
+        const SDL_Rect *src = &atlas->glyphs[i];
+        if (src->w > 0) {
+            rt_batch_copy(batch, atlas->texture, src, (float)pen_x, (float)y,
+                          (float)(pen_x + src->w), (float)(y + src->h));
+        }
+        pen_x += atlas->advance[i];
+    }
+    return pen_x - x;
+}
+
+void rt_hud_draw(RtBatch *batch, RtGlyphAtlas *atlas, TTF_Font *font, const char *const *lines, int count) {
+    if (!atlas->texture && (!font || !rt_glyphs_build(atlas, batch->renderer, font))) return;
+    
+    int width = 0;
+    for (int i = 0; i < count; i++) {
+        int line_width = rt_glyphs_width(atlas, lines[i]);
+        if (line_width > width) width = line_width;
+    }
+    
+    rt_batch_flush(batch);
+    SDL_SetRenderDrawBlendMode(batch->renderer, SDL_BLENDMODE_BLEND);
+    SDL_Color panel = {0, 0, 0, 160};
+    rt_batch_fill(batch, HUD_MARGIN / 2, HUD_MARGIN / 2, width + HUD_MARGIN * 3 / 2,
+                  count * atlas->line_height + HUD_MARGIN * 3 / 2, panel);
+    rt_batch_flush(batch);
+    SDL_SetRenderDrawBlendMode(batch->renderer, SDL_BLENDMODE_NONE);
+    for (int i = 0; i < count; i++) {
+        rt_glyphs_draw(atlas, batch, HUD_MARGIN, HUD_MARGIN + i * atlas->line_height, lines[i]);
+    }
+    rt_batch_flush(batch);
+}
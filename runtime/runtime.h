@@ -0,0 +1,150 @@
+#ifndef PLAYGROUND_RUNTIME_H
+#define PLAYGROUND_RUNTIME_H
+
+// Shared runtime for the playground games: window and renderer setup tuned for the
+// handhelds, controller hotplug, frame pacing, lazily opened fonts, a text texture cache,
+// batched quad submission and the perf HUD. Plain C so both C and C++ games can link it.
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// With SDL_RenderGeometry every run of quads sharing a texture (or none) is one driver call,
+// older SDL falls back to SDL_RenderFillRects for runs of same-colored rects
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+#define RT_BATCH_GEOMETRY 1
+#else
+#define RT_BATCH_GEOMETRY 0
+#endif
+
+#define RT_DEFAULT_REFRESH_RATE 60
+#define RT_TEXT_CACHE_SIZE 32
+#define RT_MAX_TEXT_LENGTH 256
+#define RT_FIRST_GLYPH ' '
+#define RT_LAST_GLYPH '~'
+#define RT_GLYPH_COUNT (RT_LAST_GLYPH - RT_FIRST_GLYPH + 1)
+
+// Window, renderer and the first connected controller, plus frame pacing state
+typedef struct {
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_GameController *controller;
+    bool vsync;  // Present blocks until the next refresh, otherwise rt_app_present sleeps
+    int refresh_rate;
+    Uint64 next_frame;  // Performance counter value before which no frame is presented
+    Uint32 frames_presented;
+    Uint32 start_ticks;
+} RtApp;
+
+// Initialize SDL, create the window and renderer and open a controller, false on failure
+bool rt_app_init(RtApp *app, const char *title, int width, int height);
+// Desktop resolution of the first display, for picking a window size before rt_app_init.
+// Initializes the video subsystem, which rt_app_init then reuses.
+bool rt_display_size(int *width, int *height);
+// Fonts must be closed first, SDL_ttf is shut down here
+void rt_app_quit(RtApp *app);
+// Track controller hotplug, returns true if the event was consumed
+bool rt_app_handle_event(RtApp *app, const SDL_Event *event);
+// Next event, timeout 0 polls and a negative timeout sleeps until one arrives
+bool rt_app_wait_event(RtApp *app, SDL_Event *event, int timeout);
+// Present, sleeping first if vsync is unavailable and the previous frame was too recent
+void rt_app_present(RtApp *app);
+// Frames presented against the refreshes the display showed since rt_app_init
+void rt_app_print_frame_stats(const RtApp *app);
+
+// A font opened on first use, from the first of its paths that loads
+typedef struct {
+    const char *path;
+    const char *fallback_path;  // May be NULL
+    int size;
+    TTF_Font *font;
+    bool failed;  // Every path failed, not retried
+} RtFont;
+
+void rt_font_init(RtFont *font, int size, const char *path, const char *fallback_path);
+// Open the font if needed, NULL if no path loads
+TTF_Font *rt_font_get(RtFont *font);
+void rt_font_close(RtFont *font);
+
+// A rendered string, reused for as long as the same font, text and color are drawn
+typedef struct {
+    TTF_Font *font;
+    SDL_Color color;
+    char text[RT_MAX_TEXT_LENGTH];
+    SDL_Texture *texture;
+    int w, h;
+    Uint32 last_used;
+} RtText;
+
+// Text textures by (font, string, color). Strings that stop being drawn fall out least
+// recently used first, so a changed message costs one rasterization instead of one per frame.
+typedef struct {
+    RtText entries[RT_TEXT_CACHE_SIZE];
+    Uint32 clock;
+} RtTextCache;
+
+void rt_text_cache_init(RtTextCache *cache);
+// Destroy every texture, also needed after SDL_RENDER_DEVICE_RESET
+void rt_text_cache_clear(RtTextCache *cache);
+// Cached texture of the text, NULL for empty or failed text
+const RtText *rt_text_get(RtTextCache *cache, SDL_Renderer *renderer, TTF_Font *font,
+                          const char *text, SDL_Color color);
+void rt_text_draw(RtTextCache *cache, SDL_Renderer *renderer, TTF_Font *font, const char *text,
+                  int x, int y, SDL_Color color);
+
+// Quads queued in order and sent in as few driver calls as possible. Coordinates are in
+// target pixels. Anything that changes renderer state must rt_batch_flush() first.
+typedef struct {
+    SDL_Renderer *renderer;
+    int draw_calls;  // Driver calls issued, for the perf HUD
+#if RT_BATCH_GEOMETRY
+    SDL_Texture *texture;  // Texture of the pending quads, NULL for solid fills
+    float texel_w, texel_h;
+    SDL_Vertex *vertices;
+    int vertex_count, vertex_capacity;
+    int *indices;
+    int index_count, index_capacity;
+#else
+    SDL_Color rect_color;
+    SDL_Rect *rects;
+    int rect_count, rect_capacity;
+#endif
+} RtBatch;
+
+void rt_batch_begin(RtBatch *batch, SDL_Renderer *renderer);
+void rt_batch_fill(RtBatch *batch, float x0, float y0, float x1, float y1, SDL_Color color);
+void rt_batch_copy(RtBatch *batch, SDL_Texture *texture, const SDL_Rect *src,
+                   float x0, float y0, float x1, float y1);
+// Diagonal lines are drawn right away, after flushing what is queued
+void rt_batch_line(RtBatch *batch, int x1, int y1, int x2, int y2, SDL_Color color);
+void rt_batch_flush(RtBatch *batch);
+void rt_batch_free(RtBatch *batch);
+
+// Printable ASCII rendered once from a font, so drawing text is one batched quad per character
+typedef struct {
+    SDL_Texture *texture;
+    SDL_Rect glyphs[RT_GLYPH_COUNT];  // Source rect of each glyph in the texture
+    int advance[RT_GLYPH_COUNT];  // Pen movement after the glyph
+    int line_height;
+} RtGlyphAtlas;
+
+bool rt_glyphs_build(RtGlyphAtlas *atlas, SDL_Renderer *renderer, TTF_Font *font);
+// Also needed after SDL_RENDER_DEVICE_RESET, the next rt_hud_draw rebuilds it
+void rt_glyphs_destroy(RtGlyphAtlas *atlas);
+int rt_glyphs_width(const RtGlyphAtlas *atlas, const char *text);
+// Queue one line of text at (x, y), returns its width
+int rt_glyphs_draw(const RtGlyphAtlas *atlas, RtBatch *batch, int x, int y, const char *text);
+
+// Lines of text on a translucent panel in the top left corner, two draw calls in all.
+// The atlas is built from the font on first use.
+void rt_hud_draw(RtBatch *batch, RtGlyphAtlas *atlas, TTF_Font *font, const char *const *lines, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif